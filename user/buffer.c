@@ -257,6 +257,18 @@ struct buffer_head *peekblk(map_t *map, block_t block)
 	return NULL;
 }
 
+/* Cache lookup without IO, misses blocks that hold no data yet */
+struct buffer_head *blockpeek(map_t *map, block_t block)
+{
+	struct buffer_head *buffer = peekblk(map, block);
+
+	if (buffer && buffer_empty(buffer)) {
+		blockput(buffer);
+		return NULL;
+	}
+	return buffer;
+}
+
 struct buffer_head *blockget(map_t *map, block_t block)
 {
 	struct hlist_head *bucket = map->hash + buffer_hash(block);
@@ -57,6 +57,7 @@ struct buffer_head *set_buffer_empty(struct buffer_head *buffer);
 void blockput(struct buffer_head *buffer);
 unsigned buffer_hash(block_t block);
 struct buffer_head *peekblk(map_t *map, block_t block);
+struct buffer_head *blockpeek(map_t *map, block_t block);
 struct buffer_head *blockget(map_t *map, block_t block);
 struct buffer_head *blockread(map_t *map, block_t block);
 void insert_buffer_hash(struct buffer_head *buffer);
@@ -1,9 +1,11 @@
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <linux/fs.h> // for BLKGETSIZE
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include "trace.h"
 #include "diskio.h"
 
@@ -29,6 +31,33 @@ int ioabs(int fd, void *data, size_t count, int out, off_t offset)
 	return 0;
 }
 
+/* Note: advances the caller's iovec over a short transfer */
+int iovabs(int fd, struct iovec *iov, int iovcnt, int out, off_t offset)
+{
+	while (iovcnt) {
+		ssize_t ret;
+		if (out)
+			ret = pwritev(fd, iov, iovcnt, offset);
+		else
+			ret = preadv(fd, iov, iovcnt, offset);
+		if (ret == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0)
+			return -EIO;
+		offset += ret;
+		for (; iovcnt && ret >= iov->iov_len; iov++, iovcnt--)
+			ret -= iov->iov_len;
+		if (ret) {
+			iov->iov_base += ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
 static int iorel(int fd, void *data, size_t count, int out)
 {
 	while (count) {
@@ -81,3 +110,29 @@ int fdsize64(int fd, uint64_t *size)
 	}
 	return ioctl(fd, BLKGETSIZE64, size);
 }
+
+/*
+ * Tell the device a range no longer holds data: BLKDISCARD for a block
+ * device, punch a hole for an image file.
+ */
+int fddiscard(int fd, off_t offset, off_t count)
+{
+	struct stat stat;
+	if (fstat(fd, &stat))
+		return -errno;
+	if (S_ISREG(stat.st_mode)) {
+		if (fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, offset, count))
+			return -errno;
+		return 0;
+	}
+	uint64_t range[2] = { offset, count };
+	if (ioctl(fd, BLKDISCARD, range))
+		return -errno;
+	return 0;
+}
+
+/* Ask the kernel to start reading a range we will want soon */
+int fdreadahead(int fd, off_t offset, off_t count)
+{
+	return -posix_fadvise(fd, offset, count, POSIX_FADV_WILLNEED);
+}
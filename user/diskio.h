@@ -3,12 +3,16 @@
 
 #include <inttypes.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 int ioabs(int fd, void *data, size_t count, int out, off_t offset);
+int iovabs(int fd, struct iovec *iov, int iovcnt, int out, off_t offset);
 int diskread(int fd, void *data, size_t count, off_t offset);
 int diskwrite(int fd, void *data, size_t count, off_t offset);
 int streamread(int fd, void *data, size_t count);
 int streamwrite(int fd, void *data, size_t count);
 int fdsize64(int fd, uint64_t *size);
+int fddiscard(int fd, off_t offset, off_t count);
+int fdreadahead(int fd, off_t offset, off_t count);
 
 #endif /* !TUX3_DISKIO_H */
@@ -56,14 +56,18 @@ struct buffer_head *blockdirty(struct buffer_head *buffer, unsigned newdelta)
  *  - stop at first present buffer
  *  - stop at end of file
  *
- * For both, stop when extent is "big enough", whatever that means.
+ * For both, stop when extent is "big enough", whatever that means: one
+ * extent for write, a readahead window the buffer cache can hold for read.
  */
+#define READAHEAD_BLOCKS 64
+
 static void guess_region(struct buffer_head *buffer, block_t *start, unsigned *count, int write)
 {
 	struct inode *inode = buffer_inode(buffer);
 	block_t ends[2] = { bufindex(buffer), bufindex(buffer) };
+	unsigned limit = write ? MAX_EXTENT : READAHEAD_BLOCKS;
 	for (int up = !write; up < 2; up++) {
-		while (ends[1] - ends[0] + 1 < MAX_EXTENT) {
+		while (ends[1] - ends[0] + 1 < limit) {
 			block_t next = ends[up] + (up ? 1 : -1);
 			struct buffer_head *nextbuf = peekblk(buffer->map, next);
 			if (!nextbuf) {
@@ -104,7 +108,8 @@ int filemap_extent_io(struct buffer_head *buffer, int write)
 	printf("---- extent 0x%Lx/%x ----\n", (L)start, count);
 
 	struct seg map[10];
-
+	int err = 0;
+again:;
 	int segs = map_region(inode, start, count, map, ARRAY_SIZE(map), write);
 	if (segs < 0)
 		return segs;
@@ -119,29 +124,54 @@ int filemap_extent_io(struct buffer_head *buffer, int write)
 		return -EIO;
 	}
 
-	int err = 0;
+	unsigned done = 0, mapped = 0;
 	for (int i = 0, index = start; !err && i < segs; i++) {
-		int hole = map[i].state == SEG_HOLE;
+		int hole = map[i].state & (SEG_HOLE | SEG_UNWRITTEN);
 		trace_on("extent 0x%Lx/%x => %Lx", (L)index, map[i].count, (L)map[i].block);
-		for (int j = 0; !err && j < map[i].count; j++) {
-			block_t block = map[i].block + j;
-			buffer = blockget(mapping(inode), index + j);
-			trace_on("block 0x%Lx => %Lx", (L)bufindex(buffer), (L)block);
-			if (write) {
-				err = blockio(WRITE, buffer, block);
-			} else {
-				if (hole)
-					memset(bufdata(buffer), 0, sb->blocksize);
-				else
-					err = blockio(READ, buffer, block);
+		/* Transfer each extent in as few large requests as we can */
+		for (unsigned j = 0, batch; !err && j < map[i].count; j += batch) {
+			struct buffer_head *bufvec[64];
+			batch = min_t(unsigned, map[i].count - j, ARRAY_SIZE(bufvec));
+			for (int k = 0; k < batch; k++)
+				bufvec[k] = blockget(mapping(inode), index + j + k);
+			trace_on("blocks 0x%Lx/%x => %Lx", (L)(index + j), batch, (L)(map[i].block + j));
+			if (write || !hole)
+				err = blockio_vec(write, bufvec, batch, map[i].block + j);
+			else {
+				for (int k = 0; k < batch; k++)
+					memset(bufdata(bufvec[k]), 0, sb->blocksize);
 			}
-			blockput(set_buffer_clean(buffer)); // leave empty if error ???
+			for (int k = 0; k < batch; k++)
+				blockput(set_buffer_clean(bufvec[k])); // leave empty if error ???
 		}
 		index += map[i].count;
+		done += map[i].count;
+		if (map[i].state & SEG_NEW)
+			mapped += map[i].count;
+	}
+	/* only blocks mapped just now were reserved */
+	if (write)
+		release_blocks(inode, mapped);
+	/* a fragmented volume may map less than asked, write the rest too */
+	if (write && !err && done < count) {
+		start += done;
+		count -= done;
+		goto again;
 	}
 	return err;
 }
 
+/* Is a block of the file backed by the volume, unwritten or not? */
+int filemap_mapped(struct inode *inode, block_t index)
+{
+	struct seg seg;
+	int segs = map_region(inode, index, 1, &seg, 1, 0);
+
+	if (segs < 0)
+		return segs;
+	return segs && seg.state != SEG_HOLE;
+}
+
 /*
  * FIXME: temporary hack.  The bitmap pages has possibility to
  * blockfork. It means we can't get the page buffer with blockget(),
@@ -151,7 +181,7 @@ int filemap_extent_io(struct buffer_head *buffer, int write)
  *
  * This is why we can't use filemap_extent_io() simply.
  */
-int write_bitmap(struct buffer_head *buffer)
+int write_bitmap(struct buffer_head *buffer, void *data)
 {
 	struct sb *sb = tux_sb(buffer_inode(buffer)->i_sb);
 	struct seg seg;
@@ -161,8 +191,9 @@ int write_bitmap(struct buffer_head *buffer)
 	assert(err == 1);
 	assert(buffer->state - BUFFER_DIRTY == ((sb->rollup - 1) & (BUFFER_DIRTY_STATES - 1)));
 	trace("write bitmap %Lx", (L)buffer->index);
-	err = blockio(WRITE, buffer, seg.block);
-	if (!err)
+	err = devio(WRITE, sb_dev(sb), seg.block << sb->blockbits, data, sb->blocksize);
+	/* changed since @data was taken, leave it dirty */
+	if (!err && !memcmp(data, bufdata(buffer), sb->blocksize))
 		clean_buffer(buffer);
-	return 0;
+	return err;
 }
@@ -108,6 +108,21 @@ struct inode *iget(struct sb *sb, inum_t inum)
 	return inode;
 }
 
+/*
+ * Delayed allocation: dirtying a block the volume does not back yet
+ * reserves the block writeback will map for it.  Dirty buffers are
+ * already accounted for.
+ */
+static int reserve_dirty(struct inode *inode, struct buffer_head *buffer)
+{
+	if (buffer_dirty(buffer))
+		return 0;
+	int mapped = filemap_mapped(inode, bufindex(buffer));
+	if (mapped < 0)
+		return mapped;
+	return mapped ? 0 : reserve_blocks(inode, 1);
+}
+
 static int tuxio(struct file *file, char *data, unsigned len, int write)
 {
 	int err = 0;
@@ -139,6 +154,10 @@ static int tuxio(struct file *file, char *data, unsigned len, int write)
 			break;
 		}
 		if (write){
+			if ((err = reserve_dirty(inode, buffer))) {
+				blockput(buffer);
+				break;
+			}
 			mark_buffer_dirty(buffer);
 			memcpy(bufdata(buffer) + from, data, some);
 		}
@@ -176,6 +195,31 @@ void tuxseek(struct file *file, loff_t pos)
 	file->f_pos = pos;
 }
 
+/*
+ * Preallocate [offset, offset + len) as unwritten extents, so later writes
+ * into the range find it already allocated and contiguous, while reads of
+ * it give zeros until written.  Without keep_size, extends i_size.
+ */
+int tuxfallocate(struct inode *inode, loff_t offset, loff_t len, int keep_size)
+{
+	struct sb *sb = tux_sb(inode->i_sb);
+	if (offset < 0 || len <= 0)
+		return -EINVAL;
+	if (offset + len > MAX_FILESIZE)
+		return -EFBIG;
+
+	block_t start = offset >> sb->blockbits;
+	block_t limit = (offset + len + sb->blockmask) >> sb->blockbits;
+	int err = map_prealloc(inode, start, limit - start);
+	if (err)
+		return err;
+	if (!keep_size && inode->i_size < offset + len)
+		inode->i_size = offset + len;
+	inode->i_ctime = gettime();
+	mark_inode_dirty(inode);
+	return 0;
+}
+
 /*
  * Truncate partial block, otherwise, if uses expands size with
  * truncate(), it will show existent old data.
@@ -190,11 +234,35 @@ static int truncate_partial_block(struct inode *inode, loff_t size)
 	struct buffer_head *buffer = blockread(mapping(inode), index);
 	if (!buffer)
 		return -EIO;
+	int err = reserve_dirty(inode, buffer);
+	if (err) {
+		blockput(buffer);
+		return err;
+	}
 	memset(bufdata(buffer) + offset, 0, inode->i_sb->blocksize - offset);
 	blockput_dirty(buffer);
 	return 0;
 }
 
+/*
+ * Drop the dirty buffers past the new end of file, so writeback does not
+ * map them, and release the reservations of those nothing maps yet.
+ */
+static void truncate_buffers(struct inode *inode, block_t index)
+{
+	struct buffer_head *buffer, *safe;
+	unsigned unmapped = 0;
+
+	list_for_each_entry_safe(buffer, safe, &mapping(inode)->dirty, link) {
+		if (bufindex(buffer) < index)
+			continue;
+		if (!filemap_mapped(inode, bufindex(buffer)))
+			unmapped++;
+		set_buffer_empty(buffer);
+	}
+	release_blocks(inode, unmapped);
+}
+
 int tuxtruncate(struct inode *inode, loff_t size)
 {
 	/* FIXME: expanding size is not tested */
@@ -210,8 +278,12 @@ int tuxtruncate(struct inode *inode, loff_t size)
 	inode->i_size = size;
 	if (!is_expand) {
 		truncate_partial_block(inode, size);
-		/* FIXME: invalidate the truncated (dirty) buffers */
-		err = tree_chop(&inode->btree, &(struct delete_info){ .key = index }, 0);
+		truncate_buffers(inode, index);
+		struct delete_info info = { .key = index };
+		do {
+			info.blocks = info.freed + CHOP_SLICE;
+			err = tree_chop(&inode->btree, &info, 0);
+		} while (err > 0);
 	}
 	inode->i_mtime = inode->i_ctime = gettime();
 	mark_inode_dirty(inode);
@@ -292,6 +364,8 @@ int tux_delete_inode(struct inode *inode)
 	assert(inode->i_nlink == 0);
 	if ((err = tuxtruncate(inode, 0)))
 		return err;
+	/* Nothing left to map for the dirty blocks of a deleted file */
+	release_blocks(inode, tux_inode(inode)->reserved);
 	/* FIXME: we have to free dtree-root, atable entry, etc too */
 	free_empty_btree(&tux_inode(inode)->btree);
 	if ((err = purge_inum(inode)))
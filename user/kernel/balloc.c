@@ -195,6 +195,93 @@ found:
 	return 0;
 }
 
+/*
+ * Find the longest free run in the bitmap, stopping early at @blocks.
+ * Runs do not cross bitmap blocks, so claiming one dirties one block.
+ * Returns its start and sets *@run, or returns -1 if nothing is free.
+ * Must hold the bitmap i_mutex.
+ */
+static block_t longest_free(struct sb *sb, unsigned blocks, unsigned *run)
+{
+	unsigned mapshift = sb->blockbits + 3;
+	unsigned mapblocks = (sb->volblocks + (1 << mapshift) - 1) >> mapshift;
+	block_t best = -1, at = 0, block = 0;
+	unsigned len = 0;
+
+	*run = 0;
+	for (unsigned mapblock = 0; mapblock < mapblocks; mapblock++) {
+		struct buffer_head *buffer = blockread(mapping(sb->bitmap), mapblock);
+		if (!buffer)
+			return -1;
+		unsigned char *map = bufdata(buffer);
+		len = 0;
+		for (unsigned bit = 0; bit < 1 << mapshift && block < sb->volblocks; bit++, block++) {
+			if (map[bit >> 3] & (1 << (bit & 7))) {
+				len = 0;
+				continue;
+			}
+			if (!len++)
+				at = block;
+			if (len > *run) {
+				*run = len;
+				best = at;
+				if (len == blocks)
+					break;
+			}
+		}
+		blockput(buffer);
+		if (*run == blocks)
+			break;
+	}
+	return best;
+}
+
+/*
+ * Allocate up to @blocks contiguous blocks.  If the bitmap has no free run
+ * that long, settle for the largest run there is, so a fragmented volume
+ * gives short extents instead of a false ENOSPC.
+ */
+int balloc_extent(struct sb *sb, unsigned blocks, block_t *block, unsigned *count)
+{
+	int err = balloc(sb, blocks, block);
+	if (err != -ENOSPC) {
+		*count = blocks;
+		return err;
+	}
+
+	unsigned mapshift = sb->blockbits + 3;
+	unsigned mapmask = (1 << mapshift) - 1;
+	struct buffer_head *buffer;
+	unsigned run;
+
+	err = 0;
+	/* find and claim the run under one hold, so nobody takes it between */
+	mutex_lock_nested(&sb->bitmap->i_mutex, I_MUTEX_BITMAP);
+	block_t start = longest_free(sb, blocks, &run);
+	if (start < 0) {
+		err = -ENOSPC;
+		goto out;
+	}
+	buffer = blockread(mapping(sb->bitmap), start >> mapshift);
+	if (!buffer) {
+		err = -EIO;
+		goto out;
+	}
+	buffer = blockdirty(buffer, sb->rollup);
+	// FIXME: error check of buffer
+	set_bits(bufdata(buffer), start & mapmask, run);
+	mark_buffer_dirty_non(buffer);
+	blockput(buffer);
+	sb->nextalloc = start + run;
+	sb->freeblocks -= run;
+	*block = start;
+	*count = run;
+	trace("balloc extent -> [%Lx/%x]", (L)*block, run);
+out:
+	mutex_unlock(&sb->bitmap->i_mutex);
+	return err;
+}
+
 int bfree(struct sb *sb, block_t start, unsigned blocks)
 {
 	assert(blocks > 0);
@@ -232,6 +319,195 @@ error:
 	return -EIO; // error???
 }
 
+static int cmp_extent_block(const void *a, const void *b)
+{
+	block_t x = *(u64 *)a & ~(-1ULL << 48), y = *(u64 *)b & ~(-1ULL << 48);
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Free a vector of (count << 48 | block) extents as deferred by
+ * defer_bfree().  The vector is sorted in place and adjacent extents
+ * are coalesced, so each bitmap block is read and dirtied once for the
+ * whole batch instead of once per extent.
+ */
+int bfree_extents(struct sb *sb, u64 *vec, unsigned count)
+{
+	unsigned mapshift = sb->blockbits + 3;
+	unsigned mapmask = (1 << mapshift) - 1;
+	struct buffer_head *buffer = NULL;
+	block_t mapblock = -1;
+	int err = 0, dirty = 0;
+
+	sort(vec, count, sizeof(*vec), cmp_extent_block, NULL);
+
+	/* the bitmap i_mutex is held exactly while we hold a bitmap buffer */
+	for (unsigned i = 0; i < count;) {
+		block_t start = vec[i] & ~(-1ULL << 48);
+		block_t blocks = vec[i] >> 48;
+		assert(blocks > 0);
+		while (++i < count && (vec[i] & ~(-1ULL << 48)) == start + blocks)
+			blocks += vec[i] >> 48;
+
+		trace("free <- [%Lx/%Lx]", (L)start, (L)blocks);
+		while (blocks) {
+			unsigned offset = start & mapmask;
+			unsigned len = min_t(block_t, blocks, mapmask + 1 - offset);
+			if (start >> mapshift != mapblock) {
+				if (buffer) {
+					if (dirty)
+						mark_buffer_dirty_non(buffer);
+					blockput(buffer);
+					mutex_unlock(&sb->bitmap->i_mutex);
+				}
+				mapblock = start >> mapshift;
+				/* read outside the lock, like bfree() */
+				buffer = blockread(mapping(sb->bitmap), mapblock);
+				if (!buffer) {
+					warn("could not read bitmap buffer: extent 0x%Lx\n", (L)start);
+					return -EIO;
+				}
+				mutex_lock_nested(&sb->bitmap->i_mutex, I_MUTEX_BITMAP);
+				dirty = 0;
+			}
+			if (!all_set(bufdata(buffer), offset, len)) {
+				error("double free: start 0x%Lx, blocks %x", (L)start, len);
+				err = -EIO;
+				goto out;
+			}
+			if (!dirty) {
+				buffer = blockdirty(buffer, sb->rollup);
+				// FIXME: error check of buffer
+				dirty = 1;
+			}
+			clear_bits(bufdata(buffer), offset, len);
+			sb->freeblocks += len;
+			start += len;
+			blocks -= len;
+		}
+	}
+out:
+	if (buffer) {
+		if (dirty)
+			mark_buffer_dirty_non(buffer);
+		blockput(buffer);
+		mutex_unlock(&sb->bitmap->i_mutex);
+	}
+	return err;
+}
+
+/*
+ * Discard a vector of deferred frees.  Called before the extents are
+ * cleared in the bitmap, so they cannot be reallocated and rewritten
+ * while the discard is in flight.
+ */
+void discard_extents(struct sb *sb, u64 *vec, unsigned count)
+{
+	sort(vec, count, sizeof(*vec), cmp_extent_block, NULL);
+
+	for (unsigned i = 0; i < count;) {
+		block_t start = vec[i] & ~(-1ULL << 48);
+		block_t blocks = vec[i] >> 48;
+		while (++i < count && (vec[i] & ~(-1ULL << 48)) == start + blocks)
+			blocks += vec[i] >> 48;
+
+		int err = blockdiscard(sb, start, blocks);
+		if (err == -EOPNOTSUPP) {
+			warn("device does not support discard, disabled");
+			sb->discard = 0;
+			return;
+		}
+		if (err)
+			warn("discard failed: extent 0x%Lx/%Lx (%i)", (L)start, (L)blocks, err);
+	}
+}
+
+/*
+ * Find the next run of at least @minlen free blocks in one bitmap block,
+ * from *block up to @end.  Returns the start of the run with *block at
+ * its end, or -1 with *block at @end.
+ */
+static block_t trim_scan(u8 *bitmap, unsigned mapmask, block_t *block, block_t end, unsigned minlen)
+{
+	block_t begin = -1;
+
+	for (; *block < end; (*block)++) {
+		unsigned bit = *block & mapmask;
+		unsigned char c = bitmap[bit >> 3];
+		/* whole bytes at a time where we can */
+		if (!(bit & 7) && *block + 8 <= end && (c == 0 || c == 0xff)) {
+			if (c == 0 && begin < 0)
+				begin = *block;
+			if (c == 0xff) {
+				if (begin >= 0 && *block - begin >= minlen)
+					return begin;
+				begin = -1;
+			}
+			*block += 7;
+			continue;
+		}
+		if (!(c & (1 << (bit & 7)))) {
+			if (begin < 0)
+				begin = *block;
+		} else {
+			if (begin >= 0 && *block - begin >= minlen)
+				return begin;
+			begin = -1;
+		}
+	}
+	return begin >= 0 && *block - begin >= minlen ? begin : -1;
+}
+
+/*
+ * Batch trim: discard every free run of at least @minlen blocks in the
+ * range, for volumes that do not discard as blocks are freed.  Runs are
+ * cut at bitmap block boundaries.  Each run is claimed in the bitmap and
+ * the bitmap lock dropped while it is discarded, so allocation is only
+ * held up for the scan.  The claim is undone before change_end(), so no
+ * delta ever sees it.  Returns number of blocks discarded or negative
+ * error.
+ */
+block_t trim_free(struct sb *sb, block_t start, block_t count, unsigned minlen)
+{
+	unsigned mapshift = sb->blockbits + 3;
+	unsigned mapmask = (1 << mapshift) - 1;
+	block_t limit = min(start + count, sb->volblocks);
+	block_t block = start, trimmed = 0;
+	int err = 0;
+
+	while (block < limit && !err) {
+		block_t end = min((block | mapmask) + 1, limit), begin;
+		struct buffer_head *buffer;
+
+		change_begin(sb);
+		mutex_lock_nested(&sb->bitmap->i_mutex, I_MUTEX_BITMAP);
+		buffer = blockread(mapping(sb->bitmap), block >> mapshift);
+		if (!buffer) {
+			mutex_unlock(&sb->bitmap->i_mutex);
+			change_end(sb);
+			return -EIO;
+		}
+		begin = trim_scan(bufdata(buffer), mapmask, &block, end, minlen);
+		if (begin >= 0) {
+			unsigned len = block - begin;
+			set_bits(bufdata(buffer), begin & mapmask, len);
+			sb->freeblocks -= len;
+			mutex_unlock(&sb->bitmap->i_mutex);
+
+			if (!(err = blockdiscard(sb, begin, len)))
+				trimmed += len;
+
+			mutex_lock_nested(&sb->bitmap->i_mutex, I_MUTEX_BITMAP);
+			clear_bits(bufdata(buffer), begin & mapmask, len);
+			sb->freeblocks += len;
+		}
+		mutex_unlock(&sb->bitmap->i_mutex);
+		blockput(buffer);
+		change_end(sb);
+	}
+	return err ? err : trimmed;
+}
+
 int update_bitmap(struct sb *sb, block_t start, unsigned count, int set)
 {
 	unsigned shift = sb->blockbits + 3, mask = (1 << shift) - 1;
@@ -244,7 +520,49 @@ int update_bitmap(struct sb *sb, block_t start, unsigned count, int set)
 		return -EINVAL;
 	}
 	(set ? set_bits : clear_bits)(bufdata(buffer), start & mask, count);
-	sb->freeblocks += set ? count : -count;
+	if (set)
+		sb->freeblocks -= count;
+	else
+		sb->freeblocks += count;
 	blockput_dirty(buffer);
 	return 0;
 }
+
+/*
+ * Delayed allocation: data blocks are not mapped until writeback, but the
+ * frontend has to know at write time that writeback will find the space.
+ * So each newly dirtied data block reserves one free block here, and the
+ * reservation is released when writeback maps the block.  This is a little
+ * pessimistic, an overwrite of an already mapped block reserves too.
+ */
+int reserve_blocks(struct inode *inode, unsigned blocks)
+{
+	struct sb *sb = tux_sb(inode->i_sb);
+	int err = 0;
+
+	mutex_lock_nested(&sb->bitmap->i_mutex, I_MUTEX_BITMAP);
+	if (sb->freeblocks < sb->reserved + blocks)
+		err = -ENOSPC;
+	else {
+		sb->reserved += blocks;
+		tux_inode(inode)->reserved += blocks;
+	}
+	mutex_unlock(&sb->bitmap->i_mutex);
+	trace("reserve %u blocks, reserved %Lu, err %i", blocks, (L)sb->reserved, err);
+	return err;
+}
+
+void release_blocks(struct inode *inode, unsigned blocks)
+{
+	struct sb *sb = tux_sb(inode->i_sb);
+
+	/* Buffers dirtied by metadata paths were never reserved */
+	blocks = min(blocks, tux_inode(inode)->reserved);
+	if (!blocks)
+		return;
+	mutex_lock_nested(&sb->bitmap->i_mutex, I_MUTEX_BITMAP);
+	assert(sb->reserved >= blocks);
+	sb->reserved -= blocks;
+	tux_inode(inode)->reserved -= blocks;
+	mutex_unlock(&sb->bitmap->i_mutex);
+}
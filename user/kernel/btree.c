@@ -46,6 +46,25 @@ static inline unsigned bcount(struct bnode *node)
 	return from_be_u32(node->count);
 }
 
+/*
+ * Binary search an index node for the child covering @key: return the
+ * first entry with a key above @key, the child is the one before it.
+ * The first entry's key is never looked at, it covers everything below.
+ */
+static struct index_entry *bnode_lookup(struct bnode *node, tuxkey_t key)
+{
+	unsigned lo = 1, hi = bcount(node);
+
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (from_be_u64(node->entries[mid].key) > key)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return node->entries + lo;
+}
+
 static struct buffer_head *new_block(struct btree *btree)
 {
 	block_t block;
@@ -236,6 +255,91 @@ void free_cursor(struct cursor *cursor)
 	free(cursor);
 }
 
+/*
+ * Finger search: a probe inside the key range of the last probed leaf
+ * takes the same path, so rebuild the cursor from the cached blocks and
+ * offsets instead of searching each index node.  The key range is the
+ * tightest pair of separating keys along the path.
+ *
+ * The finger only remembers block numbers, it holds no buffers.  A hit
+ * looks each block up in the cache without doing IO and falls back to
+ * the full walk if any of them has gone.  Anything that changes the
+ * index, moves a block or frees one drops the finger first, under
+ * btree->lock for write.  Concurrent probes only hold btree->lock for
+ * read, finger->lock serializes them on the finger.
+ */
+static void finger_drop(struct btree *btree)
+{
+	spin_lock(&btree->finger.lock);
+	btree->finger.depth = 0;
+	spin_unlock(&btree->finger.lock);
+}
+
+static void finger_save(struct cursor *cursor)
+{
+	struct btree *btree = cursor->btree;
+	struct btree_finger *finger = &btree->finger;
+	unsigned depth = btree->root.depth;
+
+	spin_lock(&finger->lock);
+	finger->depth = 0;
+	if (depth > FINGER_LEVELS)
+		goto out;
+	finger->start = 0;
+	finger->limit = TUXKEY_LIMIT;
+	for (unsigned i = 0; i < depth; i++) {
+		struct bnode *node = cursor_node(cursor, i);
+		struct index_entry *next = cursor->path[i].next;
+		if (next - 1 > node->entries)
+			finger->start = max(finger->start, (tuxkey_t)from_be_u64((next - 1)->key));
+		if (next < node->entries + bcount(node))
+			finger->limit = min(finger->limit, (tuxkey_t)from_be_u64(next->key));
+		finger->at[i] = next - node->entries;
+	}
+	for (unsigned i = 0; i <= depth; i++)
+		finger->block[i] = bufindex(cursor->path[i].buffer);
+	finger->depth = depth;
+out:
+	spin_unlock(&finger->lock);
+}
+
+static int finger_probe(struct cursor *cursor, tuxkey_t key)
+{
+	struct btree *btree = cursor->btree;
+	struct btree_finger *finger = &btree->finger;
+	block_t block[FINGER_LEVELS + 1];
+	unsigned at[FINGER_LEVELS];
+	unsigned i, depth;
+
+	spin_lock(&finger->lock);
+	depth = finger->depth;
+	if (!depth || depth != btree->root.depth ||
+	    key < finger->start || key >= finger->limit) {
+		spin_unlock(&finger->lock);
+		return -ENOENT;
+	}
+	memcpy(block, finger->block, (depth + 1) * sizeof(block[0]));
+	memcpy(at, finger->at, depth * sizeof(at[0]));
+	spin_unlock(&finger->lock);
+
+	for (i = 0; i <= depth; i++) {
+		struct buffer_head *buffer = vol_peek(btree->sb, block[i]);
+		if (!buffer) {
+			trace("finger miss %Lx, block %Lx not cached", (L)key, (L)block[i]);
+			release_cursor(cursor);
+			return -ENOENT;
+		}
+		if (i < depth) {
+			struct bnode *node = bufdata(buffer);
+			level_push(cursor, buffer, node->entries + at[i]);
+		} else
+			level_push(cursor, buffer, NULL);
+	}
+	trace("finger hit %Lx", (L)key);
+	cursor_check(cursor);
+	return 0;
+}
+
 int probe(struct cursor *cursor, tuxkey_t key)
 {
 	struct btree *btree = cursor->btree;
@@ -243,16 +347,15 @@ int probe(struct cursor *cursor, tuxkey_t key)
 	struct buffer_head *buffer;
 
 	assert(has_root(btree));
+	if (!finger_probe(cursor, key))
+		return 0;
 	buffer = vol_bread(btree->sb, btree->root.block);
 	if (!buffer)
 		return -EIO;
 	struct bnode *node = bufdata(buffer);
 
 	for (i = 0; i < depth; i++) {
-		struct index_entry *next = node->entries, *top = next + bcount(node);
-		while (++next < top) /* binary search goes here */
-			if (from_be_u64(next->key) > key)
-				break;
+		struct index_entry *next = bnode_lookup(node, key);
 		trace("probe level %i, %ti of %i", i, next - node->entries, bcount(node));
 		level_push(cursor, buffer, next);
 		if (!(buffer = vol_bread(btree->sb, from_be_u64((next - 1)->block))))
@@ -262,6 +365,7 @@ int probe(struct cursor *cursor, tuxkey_t key)
 	assert((btree->ops->leaf_sniff)(btree, bufdata(buffer)));
 	level_push(cursor, buffer, NULL);
 	cursor_check(cursor);
+	finger_save(cursor);
 	return 0;
 eek:
 	release_cursor(cursor);
@@ -298,6 +402,54 @@ eek:
 	return -EIO;
 }
 
+/*
+ * Range scan.  A scan keeps SCAN_READAHEAD leaves named by the lowest index
+ * node in flight, so leaf reads overlap processing of the current leaf.
+ * The whole window is hinted on entering an index node, then one more
+ * leaf per step.  Leaves starting at or past @limit are not read ahead.
+ */
+static void scan_readahead(struct cursor *cursor, struct index_entry *next, int fresh, tuxkey_t limit)
+{
+	struct btree *btree = cursor->btree;
+	struct bnode *node = cursor_node(cursor, btree->root.depth - 1);
+	struct index_entry *top = node->entries + bcount(node);
+	struct index_entry *end = next + SCAN_READAHEAD;
+
+	for (next = fresh ? next : end - 1; next < end && next < top; next++) {
+		if (from_be_u64(next->key) >= limit)
+			break;
+		blockreadahead(btree->sb, from_be_u64(next->block));
+	}
+}
+
+int scan_begin(struct cursor *cursor, tuxkey_t key, tuxkey_t limit)
+{
+	int err = probe(cursor, key);
+
+	if (!err)
+		scan_readahead(cursor, cursor->path[cursor->btree->root.depth - 1].next, 1, limit);
+	return err;
+}
+
+/*
+ * Step to the next leaf below @limit.  Like advance(), return 1, or 0 with
+ * the cursor released at the end of the range, or error.
+ */
+int scan_next(struct cursor *cursor, tuxkey_t limit)
+{
+	int depth = cursor->btree->root.depth, ret;
+
+	if (next_key(cursor, depth) >= limit) {
+		release_cursor(cursor);
+		return 0;
+	}
+	if ((ret = advance(cursor)) > 0) {
+		struct index_entry *next = cursor->path[depth - 1].next;
+		scan_readahead(cursor, next, next == cursor_node(cursor, depth - 1)->entries + 1, limit);
+	}
+	return ret;
+}
+
 /*
  * Climb up the cursor until we find the first level where we have not yet read
  * all the way to the end of the index block, there we find the key that
@@ -328,7 +480,7 @@ void show_tree_range(struct btree *btree, tuxkey_t start, unsigned count)
 	struct cursor *cursor = alloc_cursor(btree, 0);
 	if (!cursor)
 		error("out of memory");
-	if (probe(cursor, start))
+	if (scan_begin(cursor, start, TUXKEY_LIMIT))
 		error("tell me why!!!");
 	struct buffer_head *buffer;
 	do {
@@ -337,7 +489,7 @@ void show_tree_range(struct btree *btree, tuxkey_t start, unsigned count)
 		(btree->ops->leaf_dump)(btree, bufdata(buffer));
 		//tuxkey_t *next = pnext_key(cursor, btree->depth);
 		//printf("next key = %Lx:\n", next ? (L)*next : 0);
-	} while (--count && advance(cursor));
+	} while (--count && scan_next(cursor, TUXKEY_LIMIT) > 0);
 	free_cursor(cursor);
 }
 
@@ -346,6 +498,65 @@ void show_tree(struct btree *btree)
 	show_tree_range(btree, 0, -1);
 }
 
+static int stats_walk(struct btree *btree, block_t block, unsigned level,
+		      struct btree_stats *stats, block_t *prev)
+{
+	struct btree_ops *ops = btree->ops;
+	struct buffer_head *buffer;
+	int err = 0;
+
+	stats->cached += blockcached(btree->sb, block);
+	if (!(buffer = vol_bread(btree->sb, block)))
+		return -EIO;
+	if (level < btree->root.depth) {
+		struct bnode *node = bufdata(buffer);
+		stats->nodes++;
+		stats->entries += bcount(node);
+		for (unsigned i = 0; i < bcount(node) && !err; i++)
+			err = stats_walk(btree, from_be_u64(node->entries[i].block),
+					 level + 1, stats, prev);
+		blockput(buffer);
+		return err;
+	}
+
+	if (!(ops->leaf_sniff)(btree, bufdata(buffer))) {
+		blockput(buffer);
+		return -EINVAL;
+	}
+	if (ops->leaf_need && ops->leaf_free) {
+		unsigned need = (ops->leaf_need)(btree, bufdata(buffer));
+		unsigned free = (ops->leaf_free)(btree, bufdata(buffer));
+		unsigned tenth = need * STATS_FILL_BUCKETS / max(need + free, 1U);
+		stats->fill[min_t(unsigned, tenth, STATS_FILL_BUCKETS - 1)]++;
+	}
+	if (stats->leaves++ && block != *prev + 1)
+		stats->jumps++;
+	*prev = block;
+	blockput(buffer);
+	return 0;
+}
+
+/*
+ * Walk a whole btree and add its shape to @stats: nodes, leaves, leaf
+ * fill, how often the next leaf is not the next block, and how much of
+ * it was in cache already.  Reads every block, so the cache figure is
+ * only good on the first walk.  Counts add up, zero @stats once and walk
+ * any number of trees into it.
+ */
+int btree_stats(struct btree *btree, struct btree_stats *stats)
+{
+	block_t prev = 0;
+	int err;
+
+	if (!has_root(btree))
+		return 0;
+	down_read(&btree->lock);
+	stats->depth = max(stats->depth, (unsigned)btree->root.depth);
+	err = stats_walk(btree, btree->root.block, 0, stats, &prev);
+	up_read(&btree->lock);
+	return err;
+}
+
 static void level_redirect_blockput(struct cursor *cursor, int level, struct buffer_head *clone)
 {
 	struct buffer_head *buffer = cursor->path[level].buffer;
@@ -359,11 +570,20 @@ static void level_redirect_blockput(struct cursor *cursor, int level, struct buf
 	level_replace_blockput(cursor, level, clone, next);
 }
 
-int cursor_redirect(struct cursor *cursor)
+/* Point the entry at @level for the cursor's child to its new @child block */
+static void redirect_update(struct cursor *cursor, int level, block_t child)
+{
+	struct index_entry *entry = cursor->path[level].next - 1;
+
+	trace("update parent");
+	entry->block = to_be_u64(child);
+	log_bnode_update(cursor->btree->sb, bufindex(cursor->path[level].buffer),
+			 child, from_be_u64(entry->key));
+}
+
+/* Redirect clean levels one block at a time, bottom up */
+static int redirect_each(struct cursor *cursor)
 {
-#ifndef ATOMIC
-	return 0;
-#endif
 	struct btree *btree = cursor->btree;
 	unsigned level = btree->root.depth;
 	struct sb *sb = btree->sb;
@@ -371,8 +591,12 @@ int cursor_redirect(struct cursor *cursor)
 
 	while (1) {
 		struct buffer_head *buffer = cursor->path[level].buffer;
-		if (buffer_dirty(buffer))
+		if (buffer_dirty(buffer)) {
+			/* already redirected parent still points at the old child */
+			if (level < btree->root.depth)
+				redirect_update(cursor, level, child);
 			return 0;
+		}
 
 		/* Redirect buffer before changing */
 		struct buffer_head *clone = new_block(btree);
@@ -380,25 +604,23 @@ int cursor_redirect(struct cursor *cursor)
 			return PTR_ERR(clone);
 		block_t oldblock = bufindex(buffer), newblock = bufindex(clone);
 		trace("redirect block %Lx to %Lx", (L)oldblock, (L)newblock);
+		finger_drop(btree);
 		level_redirect_blockput(cursor, level, clone);
 		if (level == btree->root.depth) {
 			/* This is leaf buffer */
 			mark_buffer_dirty_atomic(clone);
 			log_leaf_redirect(sb, oldblock, newblock);
-			defer_bfree(&sb->defree, oldblock, 1);
+			defer_bfree(sb, &sb->defree, oldblock, 1);
 			goto parent_level;
 		}
 
 		/* This is bnode buffer */
 		mark_buffer_rollup_atomic(clone);
 		log_bnode_redirect(sb, oldblock, newblock);
-		defer_bfree(&sb->derollup, oldblock, 1);
+		defer_bfree(sb, &sb->derollup, oldblock, 1);
 
 		/* Update entry for the redirected child block */
-		trace("update parent");
-		struct index_entry *entry = cursor->path[level].next - 1;
-		entry->block = to_be_u64(child);
-		log_bnode_update(sb, newblock, child, from_be_u64(entry->key));
+		redirect_update(cursor, level, child);
 
 parent_level:
 		if (!level--) {
@@ -413,6 +635,92 @@ parent_level:
 	}
 }
 
+#define REDIRECT_LEVELS 8
+
+/* Count the clean levels from the leaf up, each needs a redirect */
+static unsigned redirect_plan(struct cursor *cursor)
+{
+	int level = cursor->btree->root.depth;
+	unsigned levels = 0;
+
+	while (level >= 0 && !buffer_dirty(cursor->path[level].buffer))
+		level--, levels++;
+	return levels;
+}
+
+/*
+ * Redirect every clean level on the cursor path before the leaf changes.
+ * The levels are planned first and their new blocks allocated as one
+ * extent, the leaf at the start and each parent after its child, logged
+ * as a single LOG_REDIRECT_PATH record that also stands for the parent
+ * entry updates.  Falls back to one block per level if the extent can't
+ * be had or the path is too long.
+ */
+int __cursor_redirect(struct cursor *cursor)
+{
+	struct btree *btree = cursor->btree;
+	struct sb *sb = btree->sb;
+	struct buffer_head *clone[REDIRECT_LEVELS];
+	block_t oldblocks[REDIRECT_LEVELS];
+	unsigned levels = redirect_plan(cursor), i;
+	int level = btree->root.depth;
+	block_t newbase;
+
+	if (!levels)
+		return 0;
+	if (levels == 1 || levels > REDIRECT_LEVELS ||
+	    btree->ops->balloc(sb, levels, &newbase))
+		return redirect_each(cursor);
+
+	for (i = 0; i < levels; i++) {
+		clone[i] = vol_getblk(sb, newbase + i);
+		if (!clone[i]) {
+			while (i--)
+				blockput(clone[i]);
+			btree->ops->bfree(sb, newbase, levels);
+			return -ENOMEM;
+		}
+	}
+
+	trace("redirect %u levels to %Lx", levels, (L)newbase);
+	finger_drop(btree);
+	for (i = 0; i < levels; i++, level--) {
+		block_t oldblock = oldblocks[i] = bufindex(cursor->path[level].buffer);
+		level_redirect_blockput(cursor, level, clone[i]);
+		if (!i) {
+			/* This is leaf buffer */
+			mark_buffer_dirty_atomic(clone[i]);
+			defer_bfree(sb, &sb->defree, oldblock, 1);
+			continue;
+		}
+		/* This is bnode buffer, point it at the redirected child */
+		mark_buffer_rollup_atomic(clone[i]);
+		defer_bfree(sb, &sb->derollup, oldblock, 1);
+		(cursor->path[level].next - 1)->block = to_be_u64(newbase + i - 1);
+	}
+	log_redirect_path(sb, newbase, oldblocks, levels);
+
+	if (level >= 0) {
+		redirect_update(cursor, level, newbase + levels - 1);
+		return 0;
+	}
+	trace("redirect root");
+	btree->root.block = newbase + levels - 1;
+	mark_btree_dirty(btree);
+	cursor_check(cursor);
+	return 0;
+}
+
+/* Only atomic commit writes the redirected blocks out, so far */
+int cursor_redirect(struct cursor *cursor)
+{
+#ifdef ATOMIC
+	return __cursor_redirect(cursor);
+#else
+	return 0;
+#endif
+}
+
 /* Deletion */
 
 static void remove_index(struct cursor *cursor, int level)
@@ -469,6 +777,19 @@ static void blockput_free(struct btree *btree, struct buffer_head *buffer)
 	set_buffer_empty(buffer); // free it!!! (and need a buffer free state)
 }
 
+static millisecond_t gettime_ms(void)
+{
+	struct timespec now = gettime();
+
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Chop everything from info->key on.  A chop can be bounded by a leaf
+ * budget (info->blocks) or a deadline, then it suspends with the tree
+ * consistent and btree->lock dropped, and returns 1.  Call again with the
+ * same info to resume at info->resume.  Returns 0 once done.
+ */
 int tree_chop(struct btree *btree, struct delete_info *info, millisecond_t deadline)
 {
 	int depth = btree->root.depth, level = depth - 1, suspend = 0;
@@ -486,7 +807,14 @@ int tree_chop(struct btree *btree, struct delete_info *info, millisecond_t deadl
 	memset(prev, 0, sizeof(*prev) * depth);
 
 	down_write(&btree->lock);
-	probe(cursor, info->key);	/* FIXME: info->resume? */
+	if ((ret = probe(cursor, info->resume ? : info->key))) {
+		up_write(&btree->lock);
+		free(prev);
+		free_cursor(cursor);
+		return ret;
+	}
+	/* blocks on the path get freed, their numbers must not stay in the finger */
+	finger_drop(btree);
 	leafbuf = level_pop(cursor);
 
 	/* leaf walk */
@@ -499,6 +827,7 @@ int tree_chop(struct btree *btree, struct delete_info *info, millisecond_t deadl
 				goto error_leaf_chop;
 			mark_buffer_dirty(leafbuf);
 		}
+		info->freed++;
 
 		/* try to merge this leaf with prev */
 		if (leafprev) {
@@ -519,15 +848,18 @@ int tree_chop(struct btree *btree, struct delete_info *info, millisecond_t deadl
 		leafprev = leafbuf;
 keep_prev_leaf:
 
-		//nanosleep(&(struct timespec){ 0, 50 * 1000000 }, NULL);
-		//printf("time remaining: %Lx\n", deadline - gettime());
-//		if (deadline && gettime() > deadline)
-//			suspend = -1;
+		if (deadline && (int)(gettime_ms() - deadline) >= 0)
+			suspend = -1;
 		if (info->blocks && info->freed >= info->blocks)
 			suspend = -1;
 
 		/* pop and try to merge finished nodes */
 		while (suspend || level_finished(cursor, level)) {
+			/* deepest key in the cursor is the resume address */
+			if (suspend == -1 && !level_finished(cursor, level)) {
+				suspend = 1; /* only set resume once */
+				info->resume = from_be_u64((cursor->path[level].next)->key);
+			}
 			/* try to merge node with prev */
 			if (prev[level]) {
 				assert(level); /* node has no prev */
@@ -549,12 +881,6 @@ keep_prev_leaf:
 			}
 			prev[level] = level_pop(cursor);
 keep_prev_node:
-
-			/* deepest key in the cursor is the resume address */
-			if (suspend == -1 && !level_finished(cursor, level)) {
-				suspend = 1; /* only set resume once */
-				info->resume = from_be_u64((cursor->path[level].next)->key);
-			}
 			if (!level) { /* remove depth if possible */
 				while (depth > 1 && bcount(bufdata(prev[0])) == 1) {
 					trace("drop btree level");
@@ -569,7 +895,10 @@ keep_prev_node:
 				//sb->snapmask &= ~snapmask; delete_snapshot_from_disk();
 				//set_sb_dirty(sb);
 				//save_sb(sb);
-				ret = suspend;
+				/* nothing left to resume if the budget ran out on the last leaf */
+				ret = suspend > 0;
+				if (!ret)
+					info->resume = 0;
 				goto out;
 			}
 			level--;
@@ -588,6 +917,9 @@ keep_prev_node:
 		}
 		//dirty_buffer_count_check(sb);
 		/* go to next leaf */
+		scan_readahead(cursor, cursor->path[level].next,
+			       cursor->path[level].next == cursor_node(cursor, level)->entries,
+			       TUXKEY_LIMIT);
 		if (!(leafbuf = vol_bread(sb, from_be_u64(cursor->path[level].next++->block)))) {
 			ret = -EIO;
 			goto out;
@@ -620,6 +952,17 @@ static void add_child(struct bnode *node, struct index_entry *p, block_t child,
 	node->count = to_be_u32(bcount(node) + 1);
 }
 
+/* Does the cursor insert past the last entry of every node down to @depth? */
+static int cursor_at_right_edge(struct cursor *cursor, int depth)
+{
+	for (int level = 0; level <= depth; level++) {
+		struct bnode *node = cursor_node(cursor, level);
+		if (cursor->path[level].next != node->entries + bcount(node))
+			return 0;
+	}
+	return 1;
+}
+
 /*
  * Insert new leaf to next cursor position.
  * keep == 1: keep current cursor position.
@@ -632,6 +975,7 @@ static int insert_leaf(struct cursor *cursor, tuxkey_t childkey, struct buffer_h
 	int err, depth = btree->root.depth;
 	block_t childblock = bufindex(leafbuf);
 
+	finger_drop(btree);
 	if (keep)
 		blockput(leafbuf);
 	else {
@@ -653,7 +997,11 @@ static int insert_leaf(struct cursor *cursor, tuxkey_t childkey, struct buffer_h
 			return 0;
 		}
 
-		/* split a full index node */
+		/*
+		 * Split a full index node.  Appending at the right edge of the
+		 * tree (rising inums, extents at end of file) would leave every
+		 * node half empty for good, so keep the left node full instead.
+		 */
 		struct buffer_head *newbuf = new_node(btree);
 		if (IS_ERR(newbuf)) {
 			err = PTR_ERR(newbuf);
@@ -661,6 +1009,8 @@ static int insert_leaf(struct cursor *cursor, tuxkey_t childkey, struct buffer_h
 		}
 		struct bnode *newnode = bufdata(newbuf);
 		unsigned half = bcount(parent) / 2;
+		if (cursor_at_right_edge(cursor, depth))
+			half = bcount(parent) - 1;
 		u64 newkey = from_be_u64(parent->entries[half].key);
 		newnode->count = to_be_u32(bcount(parent) - half);
 		memcpy(&newnode->entries[0], &parent->entries[half], bcount(newnode) * sizeof(struct index_entry));
@@ -758,6 +1108,186 @@ static int btree_leaf_split(struct cursor *cursor, tuxkey_t key)
 	return insert_leaf(cursor, newkey, newbuf, key < newkey);
 }
 
+/*
+ * Bulk load: build a btree bottom up from a stream of leaves in key order,
+ * instead of inserting and splitting leaf by leaf.  bulk_leaf() starts the
+ * next leaf at @key and returns it for the caller to pack full, every
+ * index node is filled up to entries_per_node before the next is started.
+ * bulk_begin() is told how many leaves are coming and allocates one extent
+ * for the whole tree, leaves first and index nodes after them, logged as
+ * one balloc.  Each index entry logs a bnode add.  The btree must be empty
+ * and stays locked until bulk_end().
+ */
+static struct buffer_head *bulk_block(struct bulk_load *bulk, block_t *next, block_t limit)
+{
+	struct buffer_head *buffer;
+
+	if (*next == limit)
+		return ERR_PTR(-E2BIG);
+	buffer = vol_getblk(bulk->btree->sb, *next);
+	if (!buffer)
+		return ERR_PTR(-ENOMEM);
+	(*next)++;
+	memset(bufdata(buffer), 0, bufsize(buffer));
+	return buffer;
+}
+
+static int bulk_add(struct bulk_load *bulk, unsigned level, tuxkey_t key, block_t child)
+{
+	struct btree *btree = bulk->btree;
+	struct sb *sb = btree->sb;
+	struct buffer_head *buffer = level < bulk->levels ? bulk->node[level] : NULL;
+
+	if (buffer && bcount(bufdata(buffer)) == sb->entries_per_node) {
+		/* full, hand it to the level above and start another */
+		struct bnode *node = bufdata(buffer);
+		int err = bulk_add(bulk, level + 1, from_be_u64(node->entries[0].key), bufindex(buffer));
+		if (err)
+			return err;
+		mark_buffer_rollup_non(buffer);
+		blockput(buffer);
+		bulk->node[level] = buffer = NULL;
+	}
+	if (!buffer) {
+		if (level == BULK_LEVELS)
+			return -E2BIG;
+		buffer = bulk_block(bulk, &bulk->nodenext, bulk->block + bulk->total);
+		if (IS_ERR(buffer))
+			return PTR_ERR(buffer);
+		mark_buffer_rollup_atomic(buffer);
+		bulk->node[level] = buffer;
+		bulk->levels = max(bulk->levels, level + 1);
+	}
+	struct bnode *node = bufdata(buffer);
+	add_child(node, node->entries + bcount(node), child, key);
+	log_bnode_add(sb, bufindex(buffer), child, key);
+	return 0;
+}
+
+static void bulk_leaf_done(struct bulk_load *bulk)
+{
+	if (bulk->leaf) {
+		mark_buffer_dirty_non(bulk->leaf);
+		blockput(bulk->leaf);
+		bulk->leaf = NULL;
+	}
+}
+
+int bulk_begin(struct btree *btree, struct bulk_load *bulk, unsigned leaves)
+{
+	struct sb *sb = btree->sb;
+	block_t total = leaves, count = leaves;
+	int err;
+
+	if (has_root(btree))
+		return -EEXIST;
+	*bulk = (struct bulk_load){ .btree = btree };
+	if (leaves) {
+		/* every level is filled up, so this is exactly what we use */
+		for (unsigned levels = 0; levels == 0 || count > 1; levels++) {
+			if (levels == BULK_LEVELS)
+				return -E2BIG;
+			count = (count + sb->entries_per_node - 1) / sb->entries_per_node;
+			total += count;
+		}
+		if ((err = btree->ops->balloc(sb, total, &bulk->block)))
+			return err;
+		log_balloc(sb, bulk->block, total);
+	}
+	bulk->total = total;
+	bulk->leafnext = bulk->block;
+	bulk->nodenext = bulk->nodebase = bulk->block + leaves;
+	down_write(&btree->lock);
+	return 0;
+}
+
+struct buffer_head *bulk_leaf(struct bulk_load *bulk, tuxkey_t key)
+{
+	struct btree *btree = bulk->btree;
+	struct buffer_head *buffer;
+	int err;
+
+	if (bulk->err)
+		return ERR_PTR(bulk->err);
+	bulk_leaf_done(bulk);
+	buffer = bulk_block(bulk, &bulk->leafnext, bulk->nodebase);
+	if (IS_ERR(buffer)) {
+		err = PTR_ERR(buffer);
+		goto error;
+	}
+	(btree->ops->leaf_init)(btree, bufdata(buffer));
+	mark_buffer_dirty_atomic(buffer);
+	if ((err = bulk_add(bulk, 0, key, bufindex(buffer)))) {
+		blockput(buffer);
+		goto error;
+	}
+	bulk->leaf = buffer;
+	get_bh(buffer);
+	return buffer;
+error:
+	bulk->err = err;
+	return ERR_PTR(err);
+}
+
+/* Give back blocks of the extent, none of them is referenced by the tree */
+static void bulk_free(struct bulk_load *bulk, block_t start, block_t end)
+{
+	struct sb *sb = bulk->btree->sb;
+
+	if (start == end)
+		return;
+	for (block_t block = start; block < end; block++) {
+		struct buffer_head *buffer = vol_peek(sb, block);
+		if (buffer) {
+			set_buffer_empty(buffer);
+			blockput(buffer);
+		}
+	}
+	log_bfree(sb, start, end - start);
+	(bulk->btree->ops->bfree)(sb, start, end - start);
+}
+
+/*
+ * Close the partly filled nodes bottom up, the single node left on the
+ * top level is the root.  With no leaves, make an empty btree.  Blocks
+ * of the extent left unused go back.  On error, including one returned
+ * earlier by bulk_leaf(), the whole extent goes back and the btree stays
+ * empty.
+ */
+int bulk_end(struct bulk_load *bulk)
+{
+	struct btree *btree = bulk->btree;
+	int err = bulk->err;
+
+	bulk_leaf_done(bulk);
+	for (unsigned level = 0; level < bulk->levels; level++) {
+		struct buffer_head *buffer = bulk->node[level];
+		if (!err && level + 1 < bulk->levels) {
+			struct bnode *node = bufdata(buffer);
+			err = bulk_add(bulk, level + 1, from_be_u64(node->entries[0].key), bufindex(buffer));
+		}
+		if (!err && level + 1 == bulk->levels)
+			btree->root = (struct root){ .block = bufindex(buffer), .depth = bulk->levels };
+		mark_buffer_rollup_non(buffer);
+		blockput(buffer);
+	}
+	if (err) {
+		btree->root = no_root;
+		bulk_free(bulk, bulk->block, bulk->block + bulk->total);
+	} else {
+		bulk_free(bulk, bulk->leafnext, bulk->nodebase);
+		bulk_free(bulk, bulk->nodenext, bulk->block + bulk->total);
+	}
+	finger_drop(btree);
+	up_write(&btree->lock);
+	if (err)
+		return err;
+	if (!bulk->levels)
+		return alloc_empty_btree(btree);
+	mark_btree_dirty(btree);
+	return 0;
+}
+
 void *tree_expand(struct cursor *cursor, tuxkey_t key, unsigned newsize)
 {
 	struct btree *btree = cursor->btree;
@@ -789,6 +1319,8 @@ void init_btree(struct btree *btree, struct sb *sb, struct root root, struct btr
 	btree->sb = sb;
 	btree->ops = ops;
 	btree->root = root;
+	btree->finger = (struct btree_finger){ };
+	spin_lock_init(&btree->finger.lock);
 	init_rwsem(&btree->lock);
 	ops->btree_init(btree);
 }
@@ -812,6 +1344,7 @@ int alloc_empty_btree(struct btree *btree)
 	rootnode->entries[0].block = to_be_u64(leafblock);
 	rootnode->count = to_be_u32(1);
 	btree->root = (struct root){ .block = rootblock, .depth = 1 };
+	finger_drop(btree);
 
 	log_bnode_root(sb, rootblock, 1, leafblock, 0, 0);
 	log_balloc(sb, leafblock, 1);
@@ -846,6 +1379,7 @@ int free_empty_btree(struct btree *btree)
 		return -EIO;
 	struct bnode *rootnode = bufdata(rootbuf);
 	assert(bcount(rootnode) == 1);
+	finger_drop(btree);
 	/* FIXME: error check */
 	(btree->ops->bfree)(sb, from_be_u64(rootnode->entries[0].block), 1);
 	(btree->ops->bfree)(sb, bufindex(rootbuf), 1);
@@ -16,8 +16,18 @@ int load_sb(struct sb *sb)
 
 	if (err)
 		return err;
-	if (memcmp(super->magic, TUX3_MAGIC, sizeof(super->magic)))
-		return -EINVAL;
+	if (memcmp(super->magic, TUX3_MAGIC, sizeof(super->magic))) {
+		/*
+		 * The 2009-03-10 format only differs in the log extent record
+		 * and the dleaf extent count.  Upgrade it if there is no log
+		 * to replay, dleaves are converted as they are probed.
+		 */
+		if (memcmp(super->magic, TUX3_MAGIC_20090310, sizeof(super->magic)))
+			return -EINVAL;
+		if (from_be_u32(super->logcount))
+			return -EINVAL;
+		memcpy(super->magic, TUX3_MAGIC, sizeof(super->magic));
+	}
 	sb->blockbits = from_be_u16(super->blockbits);
 	sb->blocksize = 1 << sb->blockbits;
 	sb->blockmask = (1 << sb->blockbits) - 1;
@@ -41,22 +51,46 @@ int load_sb(struct sb *sb)
 	return 0;
 }
 
-int save_sb(struct sb *sb)
+/*
+ * Take the super fields the frontend changes, so a delta can be saved
+ * as it was at delta transition while the next one goes on.
+ */
+static void snapshot_sb(struct sb *sb, struct sb_snapshot *snap)
+{
+	*snap = (struct sb_snapshot){
+		.iroot = pack_root(&itable_btree(sb)->root),
+		.freeblocks = sb->freeblocks,
+		.nextalloc = sb->nextalloc,
+		.atomgen = sb->atomgen,
+		.freeatom = sb->freeatom,
+		.dictsize = sb->dictsize,
+	};
+}
+
+static int write_sb(struct sb *sb, struct sb_snapshot *snap)
 {
 	struct disksuper *super = &sb->super;
 
 	super->blockbits = to_be_u16(sb->blockbits);
 	super->volblocks = to_be_u64(sb->volblocks);
-	super->freeblocks = to_be_u64(sb->freeblocks); // probably does not belong here
-	super->nextalloc = to_be_u64(sb->nextalloc); // probably does not belong here
-	super->atomgen = to_be_u32(sb->atomgen); // probably does not belong here
-	super->freeatom = to_be_u32(sb->freeatom); // probably does not belong here
-	super->dictsize = to_be_u64(sb->dictsize); // probably does not belong here
-	super->iroot = to_be_u64(pack_root(&itable_btree(sb)->root));
+	super->freeblocks = to_be_u64(snap->freeblocks); // probably does not belong here
+	super->nextalloc = to_be_u64(snap->nextalloc); // probably does not belong here
+	super->atomgen = to_be_u32(snap->atomgen); // probably does not belong here
+	super->freeatom = to_be_u32(snap->freeatom); // probably does not belong here
+	super->dictsize = to_be_u64(snap->dictsize); // probably does not belong here
+	super->iroot = to_be_u64(snap->iroot);
 	super->logchain = to_be_u64(sb->logchain);
 	return devio(WRITE, sb_dev(sb), SB_LOC, super, SB_LEN);
 }
 
+int save_sb(struct sb *sb)
+{
+	struct sb_snapshot snap;
+
+	snapshot_sb(sb, &snap);
+	return write_sb(sb, &snap);
+}
+
 int load_itable(struct sb *sb)
 {
 	u64 iroot_val = from_be_u64(sb->super.iroot);
@@ -82,6 +116,7 @@ void clean_buffer(struct buffer_head *buffer)
 
 /* Delta transition */
 
+/* Buffers that fail to write stay on @head */
 static int flush_buffer_list(struct sb *sb, struct list_head *head)
 {
 #ifndef __KERNEL__
@@ -92,7 +127,9 @@ static int flush_buffer_list(struct sb *sb, struct list_head *head)
 		buffer = list_entry(head->next, struct buffer_head, link);
 		trace(">>> flush buffer %Lx:%Lx", (L)tux_inode(buffer_inode(buffer))->inum, (L)bufindex(buffer));
 		// mapping, index set but not hashed in mapping
-		buffer->map->io(buffer, 1);
+		int err = buffer->map->io(buffer, 1);
+		if (err)
+			return err;
 		evict_buffer(buffer);
 	}
 #endif
@@ -101,10 +138,11 @@ static int flush_buffer_list(struct sb *sb, struct list_head *head)
 
 static int move_deferred(struct sb *sb, u64 val)
 {
-	return stash_value(&sb->defree, val);
+	return defer_bfree(sb, &sb->defree, val & ~(-1ULL << 48), val >> 48);
 }
 
-static int defree_logblocks(struct sb *sb, u64 val)
+/* Log a free again in the new cycle, and retire it with this delta */
+static int relog_deferred(struct sb *sb, u64 val)
 {
 	log_bfree(sb, val & ~(-1ULL << 48), val >> 48);
 	return move_deferred(sb, val);
@@ -119,7 +157,7 @@ static int new_cycle_log(struct sb *sb)
 	sb->next_logbase = sb->lognext;
 
 	/* Log the obsoleted log blocks, and add defree entries */
-	unstash(sb, &sb->decycle, defree_logblocks);
+	unstash(sb, &sb->decycle, relog_deferred);
 
 	/*
 	 * prepare ->new_decycle/decyle for next cycle. (->new_decycle
@@ -137,6 +175,10 @@ static int new_cycle_log(struct sb *sb)
  * the bitmaps and new or redirected bitmap btree nodes may be allocated
  * during the rollup.  Any bitmap blocks that are (re)dirtied by these
  * allocations will be written out in the next rollup cycle.
+ *
+ * Bitmap blocks do not fork here (blockdirty() only forks with ATOMIC),
+ * so the snapshot is only stable while the frontend is held off: this
+ * runs in the delta transition, under down_write(&sb->delta_lock).
  */
 static int rollup_log(struct sb *sb)
 {
@@ -154,132 +196,399 @@ static int rollup_log(struct sb *sb)
 
 	/* this is starting the new rollup cycle of the log */
 	new_cycle_log(sb);	/* FIXME: error handling */
+	sb->prev_cost = sb->cycle_cost;
+	sb->cycle_cost = (struct replay_cost){};
+
+	/*
+	 * Replay skips the records of the old cycle, the bitmap written
+	 * here has them.  Frees of this delta are retired after it is
+	 * written, so log them again in the new cycle.
+	 */
+	struct stash defree = sb->defree;
+	sb->defree = (struct stash){};
+	int err = unstash(sb, &defree, relog_deferred);
+	destroy_defer_bfree(sb, &defree);
 
 	/* move deferred frees for rollup to delta deferred free list */
-	unstash(sb, &sb->derollup, move_deferred);
+	if (!err)
+		err = unstash(sb, &sb->derollup, relog_deferred);
 
 	/* bnode blocks */
-	flush_buffer_list(sb, &sb->pinned);
+	if (!err)
+		err = flush_buffer_list(sb, &sb->pinned);
 
-	/* map dirty bitmap blocks to disk and write out */
+	/*
+	 * Without block fork, mapping the bitmap allocates in the very
+	 * buffers being written.  Write them as of the start of the
+	 * rollup: those allocations are logged in the new cycle, and the
+	 * buffers they change stay dirty for the next rollup.
+	 */
 	struct buffer_head *buffer, *safe;
+	unsigned count = 0;
+	list_for_each_entry(buffer, &io_buffers, link)
+		count++;
+	char *snapshot = malloc(count * sb->blocksize), *data = snapshot;
+	if (!snapshot && count && !err)
+		err = -ENOMEM;
+	if (!err) {
+		list_for_each_entry(buffer, &io_buffers, link) {
+			memcpy(data, bufdata(buffer), sb->blocksize);
+			data += sb->blocksize;
+		}
+	}
+
+	/* map dirty bitmap blocks to disk and write out */
+	data = snapshot;
 	list_for_each_entry_safe(buffer, safe, &io_buffers, link) {
-		int err = write_bitmap(buffer);
 		if (err)
-			return err;
+			break;
+		err = write_bitmap(buffer, data);
+		data += sb->blocksize;
 	}
-	assert(list_empty(&io_buffers));
+	free(snapshot);
+	/* a write error leaves the rest dirty for the next rollup */
+	list_splice_init(&io_buffers, &mapping(sb->bitmap)->dirty);
+	if (err)
+		return err;
 #endif
 
 	return 0;
 }
 
-static int stage_delta(struct sb *sb)
+/*
+ * Everything needed to flush one delta, taken from the sb at delta
+ * transition.  The sb then only holds the next delta.
+ */
+struct delta_flush {
+	unsigned delta;
+	unsigned logthis, lognext;	/* log blocks of this delta */
+	struct list_head commit;	/* dirty metadata of this delta */
+	struct stash defree;		/* frees to retire after commit */
+	struct sb_snapshot super;	/* super fields as of this delta */
+};
+
+static int stage_delta(struct sb *sb, struct delta_flush *flush)
 {
 	/* leaf blocks */
-	return flush_buffer_list(sb, &sb->commit);
+	return flush_buffer_list(sb, &flush->commit);
 }
 
-/* allocate and write log blocks */
-static int write_log(struct sb *sb)
+/*
+ * Allocate and write log blocks.  The blocks of a delta are allocated as
+ * few contiguous extents as we can get and each extent is written with
+ * one I/O.  Chain pointers are logchain_ptr() values, so replay can read
+ * a run back with one I/O too.
+ */
+static int write_log(struct sb *sb, struct delta_flush *flush)
 {
-	/* Finish to logging in this delta */
-	log_finish(sb);
-
-	for (unsigned index = sb->logthis; index < sb->lognext; index++) {
-		block_t block;
-		int err = balloc(sb, 1, &block);
+	struct buffer_head *buffers[64];
+	unsigned index = flush->logthis;
+
+	while (index < flush->lognext) {
+		unsigned want = min_t(unsigned, flush->lognext - index, ARRAY_SIZE(buffers));
+		block_t logchain = sb->logchain, block;
+		unsigned count, i;
+		int err = balloc_extent(sb, want, &block, &count);
 		if (err)
 			return err;
-		struct buffer_head *buffer = blockget(mapping(sb->logmap), index);
-		if (!buffer) {
-			bfree(sb, block, 1);
-			return -ENOMEM;
+		for (i = 0; i < count; i++) {
+			buffers[i] = blockget(mapping(sb->logmap), index + i);
+			if (!buffers[i]) {
+				err = -ENOMEM;
+				break;
+			}
+			struct logblock *log = bufdata(buffers[i]);
+			assert(log->magic == to_be_u16(TUX3_MAGIC_LOG));
+			log->logchain = to_be_u64(sb->logchain);
+			sb->logchain = logchain_ptr(block + i, i + 1);
 		}
-		struct logblock *log = bufdata(buffer);
-		assert(log->magic == to_be_u16(TUX3_MAGIC_LOG));
-		log->logchain = to_be_u64(sb->logchain);
-		err = blockio(WRITE, buffer, block);
+		if (!err)
+			err = blockio_vec(WRITE, buffers, count, block);
+		while (i--)
+			blockput(buffers[i]);
 		if (err) {
-			blockput(buffer);
-			bfree(sb, block, 1);
+			sb->logchain = logchain;
+			bfree(sb, block, count);
 			return err;
 		}
 
-		defer_bfree(&sb->new_decycle, block, 1);
-
-		blockput(buffer);
-		sb->logchain = block;
+		defer_bfree(sb, &sb->new_decycle, block, count);
+		/* log blocks are part of the delta they log */
+		flush->super.freeblocks -= count;
+		index += count;
 	}
-	sb->logthis = sb->lognext;
 
 	return 0;
 }
 
-static int retire_bfree(struct sb *sb, u64 val)
+static int retire_bfree(struct sb *sb, u64 *vec, unsigned count)
 {
-	return bfree(sb, val & ~(-1ULL << 48), val >> 48);
+	if (sb->discard)
+		discard_extents(sb, vec, count);
+	return bfree_extents(sb, vec, count);
 }
 
-static int commit_delta(struct sb *sb)
+static int commit_delta(struct sb *sb, struct delta_flush *flush)
 {
-	trace("commit %i logblocks", sb->lognext - sb->logbase);
+	trace("commit %i logblocks", flush->lognext - sb->logbase);
 	/* FIXME: Move to save_sb()? Handle wraparound of lognext, etc */
-	sb->super.logcount = to_be_u32(sb->lognext - sb->logbase);
-	sb->super.next_logcount = to_be_u32(sb->lognext - sb->next_logbase);
+	sb->super.logcount = to_be_u32(flush->lognext - sb->logbase);
+	sb->super.next_logcount = to_be_u32(flush->lognext - sb->next_logbase);
 
-	int err = save_sb(sb);
-	if (err)
-		return err;
-	return unstash(sb, &sb->defree, retire_bfree);
+	/* frees are retired by do_commit(), after the frontend is let back in */
+	return write_sb(sb, &flush->super);
 }
 
+/* Return COMMIT_* reason if the delta should commit now, otherwise -1 */
 static int need_delta(struct sb *sb)
 {
-	static unsigned crudehack;
-	return !(++crudehack % 10);
+	struct commit_policy *policy = &sb->policy;
+	struct timespec now = gettime();
+
+	if (policy->changes && atomic_read(&sb->delta_changes) >= policy->changes)
+		return COMMIT_CHANGES;
+	if (policy->dirty_blocks && sb->reserved >= policy->dirty_blocks)
+		return COMMIT_DIRTY;
+	if (policy->log_blocks && sb->lognext - sb->logthis >= policy->log_blocks)
+		return COMMIT_LOG;
+	if (!sb->delta_start.tv_sec)
+		sb->delta_start = now;
+	if (policy->interval && now.tv_sec - sb->delta_start.tv_sec >= policy->interval)
+		return COMMIT_INTERVAL;
+	return -1;
 }
 
+/*
+ * Estimated cost of replaying the log chain at mount, in block reads:
+ * the log blocks back to logbase, the bitmap blocks their records update
+ * and the records themselves.  The chain spans the previous rollup cycle
+ * and this one.
+ */
+unsigned replay_cost(struct sb *sb)
+{
+	unsigned records = sb->prev_cost.records + sb->cycle_cost.records;
+	unsigned maps = 0;
+
+	for (int i = 0; i < sizeof(sb->cycle_cost.maps); i++)
+		for (unsigned bits = sb->prev_cost.maps[i] | sb->cycle_cost.maps[i]; bits; bits &= bits - 1)
+			maps++;
+	return sb->lognext - sb->logbase + maps + records / REPLAY_RECORDS_PER_READ;
+}
+
+/*
+ * Roll up when replay would cost more than the mount-time budget, so busy
+ * volumes keep the log short and idle ones do not roll up for nothing.
+ */
 static int need_rollup(struct sb *sb)
 {
-	static unsigned crudehack;
-	return !(++crudehack % 3);
+	struct commit_policy *policy = &sb->policy;
+
+	if (policy->rollup_deltas && sb->delta - sb->rollup_delta >= policy->rollup_deltas)
+		return 1;
+	if (policy->replay_budget && replay_cost(sb) >= policy->replay_budget)
+		return 1;
+	return 0;
 }
 
-/* must hold down_write(&sb->delta_lock) */
-static int do_commit(struct sb *sb, int can_rollup)
+/*
+ * Delta transition: start the next delta and take everything that belongs
+ * to the old one out of the sb.  Must hold down_write(&sb->delta_lock) and
+ * sb->commit_lock.
+ */
+static int delta_transition(struct sb *sb, struct delta_flush *flush,
+			    int can_rollup, int reason)
 {
-	int err = 0;
+	struct delta_stats *stats = &sb->last_delta;
 
 	trace(">>>>>>>>> commit delta %u", sb->delta);
+	*stats = (struct delta_stats){
+		.delta = sb->delta,
+		.reason = reason,
+		.changes = atomic_read(&sb->delta_changes),
+		.dirty_blocks = sb->reserved,
+		.log_blocks = sb->lognext - sb->logthis,
+	};
 	/* further changes of frontend belong to the next delta */
-	sb->delta++;
+	flush->delta = sb->delta++;
+	atomic_set(&sb->delta_changes, 0);
+	sb->delta_start = gettime();
 
+	/*
+	 * FIXME: the rollup is written here in one go.  Spreading it over
+	 * the next deltas needs bitmap and bnode buffers to fork: they are
+	 * changed again in those deltas, and replay must find the bitmap as
+	 * of the rollup, not partly newer.
+	 */
 	if (can_rollup && need_rollup(sb)) {
-		err = rollup_log(sb);
+		int err = rollup_log(sb);
 		if (err)
 			return err;
+		sb->rollup_delta = sb->delta;
+		stats->rollup = 1;
 	}
-	stage_delta(sb);
-	write_log(sb);
-	commit_delta(sb);
-	trace("<<<<<<<<< commit done %u", sb->delta - 1);
 
-	return err; /* FIXME: error handling */
+	/* Finish to logging in this delta */
+	mutex_lock(&sb->loglock);
+	log_finish(sb);
+	/* log blocks before next_logbase belong to the old cycle, keep them */
+	sb->lognext = log_compact(sb, max(sb->logthis, sb->next_logbase), sb->lognext);
+	mutex_unlock(&sb->loglock);
+	stats->log_blocks = sb->lognext - sb->logthis;
+	stats->replay_cost = replay_cost(sb);
+	flush->logthis = sb->logthis;
+	flush->lognext = sb->logthis = sb->lognext;
+	list_splice_init(&sb->commit, &flush->commit);
+	flush->defree = sb->defree;
+	sb->defree = (struct stash){};
+	snapshot_sb(sb, &flush->super);
+
+	return 0;
 }
 
-/* FIXME: untested */
-int force_delta(struct sb *sb)
+/*
+ * Write out the old delta and commit it.  Deltas are flushed in order
+ * under sb->commit_lock.
+ */
+static int flush_delta(struct sb *sb, struct delta_flush *flush)
 {
+	struct delta_stats *stats = &sb->last_delta;
+	struct timespec start = sb->delta_start;
 	int err;
 
-	down_write(&sb->delta_lock);
-	err = do_commit(sb, 0);
+	/* a delta missing from the log chain can not be committed over */
+	if ((err = sb->commit_err))
+		goto error;
+	if ((err = stage_delta(sb, flush)))
+		goto error;
+	if ((err = write_log(sb, flush)))
+		goto error;
+	if ((err = commit_delta(sb, flush)))
+		goto error;
+
+	struct timespec end = gettime();
+	stats->usecs = (end.tv_sec - start.tv_sec) * 1000000 +
+		(end.tv_nsec - start.tv_nsec) / 1000;
+	sb->commits[stats->reason]++;
+	sb->committed = flush->delta + 1;
+	trace("<<<<<<<<< commit done %u: reason %u, %u changes, %u log blocks, %u usecs%s",
+	      flush->delta, stats->reason, stats->changes, stats->log_blocks,
+	      stats->usecs, stats->rollup ? ", rollup" : "");
+	return 0;
+
+error:
+	/*
+	 * The delta stays uncommitted.  Keep what was not written and the
+	 * frees it would have retired, so nothing is reused or lost.
+	 */
+	warn("delta %u failed to commit, error %i", flush->delta, err);
+	if (!sb->commit_err)
+		sb->commit_err = err;
+	list_splice_init(&flush->commit, &sb->commit);
+	unstash(sb, &flush->defree, move_deferred);
+	destroy_defer_bfree(sb, &flush->defree);
+	return err;
+}
+
+/*
+ * Must hold down_write(&sb->delta_lock), released when the delta is on
+ * disk.  Buffers do not fork yet (blockdirty() only forks with ATOMIC),
+ * so the frontend has to stay out until the flush has written them.
+ *
+ * Retiring the frees, with their discards, does not need the frontend
+ * out: the blocks stay allocated until then and the bitmap lock orders
+ * the frees against balloc().  So the frontend runs again while they are
+ * discarded, and commit_lock keeps the next delta waiting for them.
+ */
+static int do_commit(struct sb *sb, int can_rollup, int reason)
+{
+	struct delta_flush flush = { .commit = LIST_HEAD_INIT(flush.commit) };
+	int err;
+
+	mutex_lock(&sb->commit_lock);
+	err = delta_transition(sb, &flush, can_rollup, reason);
+	if (!err)
+		err = flush_delta(sb, &flush);
 	up_write(&sb->delta_lock);
 
+	if (!err) {
+		err = unstash_vec(sb, &flush.defree, retire_bfree);
+		destroy_defer_bfree(sb, &flush.defree);
+	}
+	mutex_unlock(&sb->commit_lock);
+
 	return err;
 }
 
+static int delta_empty(struct sb *sb)
+{
+	return !atomic_read(&sb->delta_changes) && !sb->logbuf && sb->logthis == sb->lognext &&
+		list_empty(&sb->commit) && flink_empty(&sb->defree.head);
+}
+
+/*
+ * Group commit: return once @delta is on disk.  A caller whose delta is
+ * already committed, or is being flushed for someone else, shares that
+ * commit instead of forcing one of its own, so concurrent syncs cost one
+ * log write and one superblock write.
+ */
+int sync_delta(struct sb *sb, unsigned delta)
+{
+	if ((int)(sb->committed - delta) > 0)
+		return 0;
+
+	down_write(&sb->delta_lock);
+	if (sb->delta == delta) {
+		/* nothing to write, on disk once the deltas before it are */
+		if (delta_empty(sb)) {
+			up_write(&sb->delta_lock);
+			return sb->commit_err;
+		}
+		return do_commit(sb, 0, COMMIT_FORCE);
+	}
+	up_write(&sb->delta_lock);
+
+	/* a failed flush leaves that delta and all later ones uncommitted */
+	if ((int)(sb->committed - delta) > 0)
+		return 0;
+	return sb->commit_err;
+}
+
+int force_delta(struct sb *sb)
+{
+	return sync_delta(sb, sb->delta);
+}
+
+static const char *commit_reasons[COMMIT_REASONS] = {
+	[COMMIT_FORCE] = "force",
+	[COMMIT_CHANGES] = "changes",
+	[COMMIT_DIRTY] = "dirty",
+	[COMMIT_LOG] = "log",
+	[COMMIT_INTERVAL] = "interval",
+};
+
+/*
+ * Deltas committed by reason and what the last one cost, as text for
+ * tux3 stat and /proc/self/mountstats.  Returns @size or more if @buf
+ * was too small, like snprintf.
+ */
+int format_delta_stats(struct sb *sb, char *buf, size_t size)
+{
+	struct delta_stats *stats = &sb->last_delta;
+	int len = snprintf(buf, size, "deltas committed %u:", sb->committed);
+
+	for (int i = 0; i < COMMIT_REASONS && len < size; i++)
+		len += snprintf(buf + len, size - len, " %s %lu",
+				commit_reasons[i], sb->commits[i]);
+	if (len >= size)
+		return len;
+	return len + snprintf(buf + len, size - len,
+		"\nlast delta %u: %s, %u changes, %Lu dirty blocks, %u log blocks, "
+		"replay cost %u, %u usecs%s\n", stats->delta,
+		commit_reasons[stats->reason], stats->changes,
+		(L)stats->dirty_blocks, stats->log_blocks, stats->replay_cost,
+		stats->usecs, stats->rollup ? ", rollup" : "");
+}
+
 int change_begin(struct sb *sb)
 {
 #ifndef __KERNEL__
@@ -292,7 +601,9 @@ int change_end(struct sb *sb)
 {
 	int err = 0;
 #ifndef __KERNEL__
-	if (!need_delta(sb)) {
+	atomic_inc(&sb->delta_changes);
+	int reason = need_delta(sb);
+	if (reason < 0) {
 		up_read(&sb->delta_lock);
 		return 0;
 	}
@@ -300,10 +611,10 @@ int change_end(struct sb *sb)
 	up_read(&sb->delta_lock);
 
 	down_write(&sb->delta_lock);
-	/* FIXME: error handling */
 	if (sb->delta == delta)
-		err = do_commit(sb, 1);
-	up_write(&sb->delta_lock);
+		err = do_commit(sb, 1, reason);
+	else
+		up_write(&sb->delta_lock);
 #endif
 	return err;
 }
@@ -76,7 +76,7 @@ static void dleaf_btree_init(struct btree *btree)
 int dleaf_init(struct btree *btree, vleaf *leaf)
 {
 	*to_dleaf(leaf) = (struct dleaf){
-		.magic = to_be_u16(TUX3_MAGIC_DLEAF),
+		.magic = to_be_u16(TUX3_MAGIC_DLEAF2),
 		.free = to_be_u16(sizeof(struct dleaf)),
 		.used = to_be_u16(btree->sb->blocksize) };
 	return 0;
@@ -84,7 +84,35 @@ int dleaf_init(struct btree *btree, vleaf *leaf)
 
 static int dleaf_sniff(struct btree *btree, vleaf *leaf)
 {
-	return to_dleaf(leaf)->magic == to_be_u16(TUX3_MAGIC_DLEAF);
+	return to_dleaf(leaf)->magic == to_be_u16(TUX3_MAGIC_DLEAF2) ||
+		to_dleaf(leaf)->magic == to_be_u16(TUX3_MAGIC_DLEAF);
+}
+
+/*
+ * Leaves from before dleaf2 have version:9, count:6 where dleaf2 has
+ * count:15.  Versions were never assigned, so with the version bits clear
+ * the old extents are valid dleaf2 extents as they are, and converting the
+ * leaf only changes its magic.  Readers walk an old leaf as it is, a
+ * writer converts it under the btree write lock, then dirties the leaf
+ * with its own changes.  A leaf with versions set can not be used.
+ */
+int dleaf_convert(struct dleaf *leaf, int write)
+{
+	struct diskextent *extent = leaf->table;
+	struct diskextent *limit = (void *)leaf + from_be_u16(leaf->free);
+
+	if (leaf->magic != to_be_u16(TUX3_MAGIC_DLEAF))
+		return 0;
+	for (; extent < limit; extent++) {
+		/* old layout: version:10 above count:6, none may be set */
+		if (from_be_u64(extent->block_count_version) & ~((1ULL << 54) - 1)) {
+			warn("versioned extents, can not convert dleaf %p", leaf);
+			return -EINVAL;
+		}
+	}
+	if (write)
+		leaf->magic = to_be_u16(TUX3_MAGIC_DLEAF2);
+	return 0;
 }
 
 unsigned dleaf_free(struct btree *btree, vleaf *leaf)
@@ -132,6 +160,8 @@ void dleaf_dump(struct btree *btree, vleaf *vleaf)
 				printf(" %Lx", (L)extent_block(extent));
 				if (extent_count(extent))
 					printf("/%x", extent_count(extent));
+				if (extent_unwritten(extent))
+					printf("u");
 			}
 			//printf(" {%u}", entry_limit(entry));
 			printf(";");
@@ -274,6 +304,9 @@ int dleaf_split_at(vleaf *from, vleaf *into, struct entry *entry, unsigned block
 
 /*
  * Split dleaf at middle in terms of entries, may be unbalanced in extents.
+ * Inserting past the last entry is an append, so only move the last entry
+ * out and leave this leaf full instead of half empty for good, same as
+ * insert_leaf() does for index nodes.
  * Not used for now because we do the splits by hand in filemap.c
  */
 static tuxkey_t dleaf_split(struct btree *btree, tuxkey_t key, vleaf *from, vleaf *into)
@@ -285,7 +318,10 @@ static tuxkey_t dleaf_split(struct btree *btree, tuxkey_t key, vleaf *from, vlea
 	struct entry *edict = (void *)gbase;
 	struct entry *ebase = (void *)leaf + from_be_u16(leaf->used);
 	unsigned entries = edict - ebase;
-	unsigned groups2 = dleaf_split_at(from, into, edict - entries / 2, blocksize);
+	struct entry *at = edict - entries / 2;
+	if (entries > 1 && key > get_index(gbase, ebase))
+		at = ebase;
+	unsigned groups2 = dleaf_split_at(from, into, at, blocksize);
 	struct group *gdict2 = (void *)leaf2 + blocksize;
 
 	return get_index(gdict2 - 1, (struct entry *)(gdict2 - groups2) - 1);
@@ -437,6 +473,11 @@ unsigned dwalk_count(struct dwalk *walk)
 	return extent_count(*walk->extent);
 }
 
+int dwalk_unwritten(struct dwalk *walk)
+{
+	return extent_unwritten(*walk->extent);
+}
+
 /* unused */
 void dwalk_dump(struct dwalk *walk)
 {
@@ -797,9 +838,12 @@ static int dleaf_chop(struct btree *btree, tuxkey_t chop, vleaf *vleaf)
 	struct sb *sb = btree->sb;
 	struct dleaf *leaf = to_dleaf(vleaf);
 	struct dwalk walk;
+	int err;
 
 	if (!dwalk_probe(leaf, sb->blocksize, &walk, chop))
 		return 0;
+	if ((err = dleaf_convert(leaf, 1)))
+		return err;
 
 	/* Chop this extent partially */
 	if (dwalk_index(&walk) < chop) {
@@ -808,7 +852,7 @@ static int dleaf_chop(struct btree *btree, tuxkey_t chop, vleaf *vleaf)
 
 		/* FIXME: err check? */
 		(btree->ops->bfree)(sb, block + count, dwalk_count(&walk) - count);
-		dwalk_update(&walk, make_extent(block, count));
+		dwalk_update(&walk, set_extent_unwritten(make_extent(block, count), dwalk_unwritten(&walk)));
 		if (!dwalk_next(&walk))
 			goto out;
 	}
@@ -24,7 +24,7 @@
  * sb->delta_lock (change_begin, change_end)
  *
  * This lock may be last lock. (care about blockget())
- * sb->loglock (log_begin, log_end)
+ * sb->loglock (log_begin, only to start next log block)
  *
  * memory allocation: (blockread, blockget, kmalloc, etc.)
  *     lock_page() (for write)
@@ -72,6 +72,7 @@ static void put_bitmap_write(struct sb *sb)
 
 #define SEG_HOLE	(1 << 0)
 #define SEG_NEW		(1 << 1)
+#define SEG_UNWRITTEN	(1 << 2)	/* Preallocated extent, reads as zero */
 
 struct seg { block_t block; unsigned count; unsigned state; };
 
@@ -89,14 +90,20 @@ static int map_bfree(struct inode *inode, block_t block, unsigned count)
 	struct sb *sb = tux_sb(inode->i_sb);
 	if (inode == sb->bitmap) {
 		log_bfree_on_rollup(sb, block, count);
-		defer_bfree(&sb->derollup, block, count);
+		defer_bfree(sb, &sb->derollup, block, count);
 	} else {
 		log_bfree(sb, block, count);
-		defer_bfree(&sb->defree, block, count);
+		defer_bfree(sb, &sb->defree, block, count);
 	}
 	return 0;
 }
 
+/*
+ * create: 0 - read, 1 - write, 2 - redirect, 3 - preallocate
+ *
+ * Preallocation fills holes with extents marked unwritten and leaves mapped
+ * extents alone.  A write converts the unwritten extents it covers.
+ */
 static int map_region(struct inode *inode, block_t start, unsigned count, struct seg map[], unsigned max_segs, int create)
 {
 	struct sb *sb = tux_sb(inode->i_sb);
@@ -142,6 +149,10 @@ static int map_region(struct inode *inode, block_t start, unsigned count, struct
 			goto out_unlock;
 		}
 		leaf = bufdata(cursor_leafbuf(cursor));
+		if ((err = dleaf_convert(leaf, 0))) {
+			segs = err;
+			goto out_release;
+		}
 		dleaf_dump(btree, leaf);
 		dwalk_probe(leaf, sb->blocksize, walk, start);
 	} else {
@@ -179,7 +190,11 @@ static int map_region(struct inode *inode, block_t start, unsigned count, struct
 			block = dwalk_block(walk);
 			count = dwalk_count(walk);
 			trace("emit %Lx/%x", (L)block, count );
-			map[segs++] = (struct seg){ .block = block, .count = count };
+			map[segs++] = (struct seg){
+				.block = block,
+				.count = count,
+				.state = dwalk_unwritten(walk) ? SEG_UNWRITTEN : 0,
+			};
 			index = ex_index + count;
 			dwalk_next(walk);
  		}
@@ -197,6 +212,9 @@ static int map_region(struct inode *inode, block_t start, unsigned count, struct
 	block_t below_block, above_block;
 	below_block = map[0].block - below;
 	above_block = map[segs - 1].block + map[segs - 1].count;
+	/* Partial extents put back below and above keep their state */
+	int below_unwritten = !!(map[0].state & SEG_UNWRITTEN);
+	int above_unwritten = !!(map[segs - 1].state & SEG_UNWRITTEN);
 	if (create == 2) {
 		/* Change the map[] to redirect this region as one extent */
 		count = 0;
@@ -213,8 +231,9 @@ static int map_region(struct inode *inode, block_t start, unsigned count, struct
 	}
 	for (int i = 0; i < segs; i++) {
 		if (map[i].state == SEG_HOLE) {
+			unsigned got;
 			count = map[i].count;
-			if ((err = balloc(sb, count, &block))) { // goal ???
+			if ((err = balloc_extent(sb, count, &block, &got))) { // goal ???
 				/*
 				 * Out of space on file data allocation.  It happens.  Tread
 				 * carefully.  We have not stored anything in the btree yet,
@@ -232,13 +251,40 @@ static int map_region(struct inode *inode, block_t start, unsigned count, struct
 				segs = err;
 				goto out_release;
 			}
+			if (got < count) {
+				/*
+				 * Only a shorter extent was free.  Split the
+				 * hole, the remainder gets the next pass.  With
+				 * no room for another seg, end the region here
+				 * and return what is mapped, the caller maps the
+				 * rest with another call.  Redirect maps only one
+				 * block, so always gets the whole hole.
+				 */
+				assert(create != 2);
+				if (segs < max_segs) {
+					memmove(map + i + 2, map + i + 1, (segs - i - 1) * sizeof(*map));
+					map[i + 1] = (struct seg){ .count = count - got, .state = SEG_HOLE };
+					segs++;
+				} else {
+					block_t end = start + got;
+					for (int j = 0; j < i; j++)
+						end += map[j].count;
+					segs = i + 1;
+					above = 0;
+					/* extents past the new end go back in with the tail */
+					*walk = headwalk;
+					dwalk_probe(leaf, sb->blocksize, walk, end);
+				}
+				count = got;
+			}
 			log_balloc(sb, block, count);
 			trace("fill in %Lx/%i ", (L)block, count);
 			map[i] = (struct seg){
 				.block = block,
 				.count = count,
 				/* if create == 2, buffer should be dirty */
-				.state = create == 2 ? 0 : SEG_NEW,
+				.state = create == 2 ? 0 :
+					create == 3 ? SEG_NEW | SEG_UNWRITTEN : SEG_NEW,
 			};
 		}
 	}
@@ -248,6 +294,7 @@ static int map_region(struct inode *inode, block_t start, unsigned count, struct
 		segs = err;
 		goto out_release;
 	}
+	dleaf_convert(leaf, 1);
 	struct dleaf *tail = NULL;
 	tuxkey_t tailkey = 0; // probably can just use limit instead
 	if (!dwalk_end(walk)) {
@@ -281,17 +328,19 @@ static int map_region(struct inode *inode, block_t start, unsigned count, struct
 		}
 		if (i < 0) {
 			trace("emit below");
-			dwalk_add(&headwalk, seg_start, make_extent(below_block, below));
+			dwalk_add(&headwalk, seg_start, set_extent_unwritten(make_extent(below_block, below), below_unwritten));
 			continue;
 		}
 		if (i == segs) {
 			trace("emit above");
-			dwalk_add(&headwalk, index, make_extent(above_block, above));
+			dwalk_add(&headwalk, index, set_extent_unwritten(make_extent(above_block, above), above_unwritten));
 			continue;
 		}
 		trace("pack 0x%Lx => %Lx/%x", (L)index, (L)map[i].block, map[i].count);
 		dleaf_dump(btree, leaf);
-		dwalk_add(&headwalk, index, make_extent(map[i].block, map[i].count));
+		/* Only preallocation leaves extents unwritten, writes convert them */
+		int unwritten = create == 3 && (map[i].state & SEG_UNWRITTEN);
+		dwalk_add(&headwalk, index, set_extent_unwritten(make_extent(map[i].block, map[i].count), unwritten));
 		dleaf_dump(btree, leaf);
 		index += map[i].count;
 	}
@@ -337,6 +386,26 @@ out_unlock:
 	return segs;
 }
 
+/*
+ * Allocate blocks for the holes in [start, start + count) up front, as
+ * extents marked unwritten.  Mapped extents in the range are kept.
+ */
+int map_prealloc(struct inode *inode, block_t start, block_t count)
+{
+	block_t limit = start + count;
+
+	while (start < limit) {
+		struct seg map[10];
+		unsigned chunk = min_t(block_t, limit - start, MAX_EXTENT);
+		int segs = map_region(inode, start, chunk, map, ARRAY_SIZE(map), 3);
+		if (segs < 0)
+			return segs;
+		for (int i = 0; i < segs; i++)
+			start += map[i].count;
+	}
+	return 0;
+}
+
 #ifdef __KERNEL__
 #include <linux/mpage.h>
 
@@ -372,8 +441,15 @@ static int __tux3_get_block(struct inode *inode, sector_t iblock,
 	assert(segs == 1);
 	size_t blocks = min_t(size_t, max_blocks, seg.count);
 	switch (seg.state) {
+	case SEG_UNWRITTEN:
+		/* Reads as a hole until written, map_region converted it */
+		if (create)
+			goto mapped_new;
+		/* FALLTHROUGH */
 	case SEG_HOLE:
 		if (delalloc && !buffer_delay(bh_result)) {
+			if (reserve_blocks(inode, blocks))
+				return -ENOSPC;
 			map_bh(bh_result, inode->i_sb, 0);
 			set_buffer_new(bh_result);
 			set_buffer_delay(bh_result);
@@ -384,9 +460,11 @@ static int __tux3_get_block(struct inode *inode, sector_t iblock,
 		assert(create && !delalloc);
 		assert(seg.block);
 		inode->i_blocks += blocks << (sb->blockbits - 9);
+	mapped_new:
 		if (buffer_delay(bh_result)) {
 			/* for now, block_write_full_page() clear delay */
 //			clear_buffer_delay(bh_result);
+			release_blocks(inode, blocks);
 			bh_result->b_blocknr = seg.block;
 			/*
 			 * FIXME: do we need to unmap_underlying_metadata()
@@ -412,7 +490,7 @@ static int __tux3_get_block(struct inode *inode, sector_t iblock,
 static int tux3_da_get_block(struct inode *inode, sector_t iblock,
 			     struct buffer_head *bh_result, int create)
 {
-	/* FIXME: We should reserve the space */
+	/* FIXME: release the reservation when a delayed page is invalidated */
 	return __tux3_get_block(inode, iblock, bh_result, 3);
 }
 
@@ -453,6 +531,19 @@ static struct buffer_head *get_buffer(struct address_space *mapping,
 	return bh;
 }
 
+/* Cache lookup without IO, misses blocks that are not uptodate */
+struct buffer_head *blockpeek(struct address_space *mapping, block_t iblock)
+{
+	struct inode *inode = mapping->host;
+	pgoff_t index;
+	int offset;
+
+	index = iblock >> (PAGE_CACHE_SHIFT - inode->i_blkbits);
+	offset = iblock & ((1 << (PAGE_CACHE_SHIFT - inode->i_blkbits)) - 1);
+
+	return get_buffer(mapping, index, offset);
+}
+
 struct buffer_head *blockread(struct address_space *mapping, block_t iblock)
 {
 	struct inode *inode = mapping->host;
@@ -503,6 +594,45 @@ error:
 	return NULL;
 }
 
+/* Does the cache hold the data of a volume block? */
+int blockcached(struct sb *sb, block_t block)
+{
+	struct buffer_head *buffer = blockpeek(mapping(sb->volmap), block);
+
+	if (!buffer)
+		return 0;
+	blockput(buffer);
+	return 1;
+}
+
+/* Start reading a volume block into the cache, without waiting for it */
+void blockreadahead(struct sb *sb, block_t block)
+{
+	struct address_space *mapping = mapping(sb->volmap);
+	struct inode *inode = mapping->host;
+	pgoff_t index = block >> (PAGE_CACHE_SHIFT - inode->i_blkbits);
+	struct page *page;
+
+	/* cached, or somebody is already reading it */
+	page = find_get_page(mapping, index);
+	if (page) {
+		page_cache_release(page);
+		return;
+	}
+	/* only a hint, give up rather than wait for the page lock */
+	page = grab_cache_page_nowait(mapping, index);
+	if (!page)
+		return;
+
+	if (!page_has_buffers(page))
+		create_empty_buffers(page, sb->blocksize, 0);
+	if (PageUptodate(page))
+		unlock_page(page);
+	else
+		mapping->a_ops->readpage(NULL, page); /* unlocks at end of IO */
+	page_cache_release(page);
+}
+
 struct buffer_head *blockget(struct address_space *mapping, block_t iblock)
 {
 	struct inode *inode = mapping->host;
@@ -295,6 +295,25 @@ inum_t find_empty_inode(struct btree *btree, struct ileaf *leaf, inum_t goal)
 	return ibase(leaf) + at;
 }
 
+/* Call actor() for each inode in the leaf, stop if it returns nonzero */
+int ileaf_enumerate(struct btree *btree, struct ileaf *leaf,
+		    int (*actor)(void *data, inum_t inum), void *data)
+{
+	be_u16 *dict = (void *)leaf + btree->sb->blocksize;
+	unsigned offset = 0;
+
+	for (unsigned at = 0; at < icount(leaf); at++) {
+		unsigned limit = __atdict(dict, at + 1);
+		if (limit > offset) {
+			int ret = actor(data, ibase(leaf) + at);
+			if (ret)
+				return ret;
+		}
+		offset = limit;
+	}
+	return 0;
+}
+
 void ileaf_purge(struct btree *btree, inum_t inum, struct ileaf *leaf)
 {
 	assert(inum >= ibase(leaf));
@@ -319,6 +338,8 @@ struct btree_ops itable_ops = {
 	.leaf_dump = ileaf_dump,
 	.leaf_sniff = ileaf_sniff,
 	.leaf_init = ileaf_init,
+	.leaf_need = ileaf_need,
+	.leaf_free = ileaf_free,
 	.leaf_split = ileaf_split,
 	.leaf_resize = ileaf_resize,
 	.balloc = balloc,
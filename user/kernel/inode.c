@@ -432,7 +432,18 @@ static void __tux3_truncate(struct inode *inode)
 	/* FIXME: must fix expand size */
 	WARN_ON(inode->i_size);
 	block_truncate_page(inode->i_mapping, inode->i_size, tux3_get_block);
-	err = tree_chop(&tux_inode(inode)->btree, &del_info, 0);
+	/*
+	 * Chop in slices, each taking and dropping the btree lock, so other
+	 * btree users get in between.  That only bounds how long the btree
+	 * lock is held: the whole truncate is one change, in one delta.
+	 *
+	 * FIXME: to end the change between slices, the part not chopped
+	 * yet must be recorded (orphan record) so replay can finish it.
+	 */
+	do {
+		del_info.blocks = del_info.freed + CHOP_SLICE;
+		err = tree_chop(&tux_inode(inode)->btree, &del_info, 0);
+	} while (err > 0);
 	inode->i_blocks = ((inode->i_size + sb->blockmask)
 			   & ~(loff_t)sb->blockmask) >> 9;
 	inode->i_mtime = inode->i_ctime = gettime();
@@ -5,6 +5,10 @@
 
 #include "tux3.h"
 
+#ifndef trace
+#define trace trace_off
+#endif
+
 /*
  * Log cache scheme
  *
@@ -58,17 +62,41 @@
  *
  *  - Log block header records size of log block payload in ->bytes.
  *
- *  - Each log block entry has a one byte type code implying its length.
+ *  - Each log block entry has a one byte type code implying its length,
+ *    except LOG_REDIRECT_PATH whose second byte counts its old blocks.
  *
  *  - Integer fields are big endian, byte aligned.
  *
  */
 
+const unsigned logsize[LOG_TYPES] = {
+	[LOG_BALLOC] = 9,
+	[LOG_BFREE] = 9,
+	[LOG_BFREE_ON_ROLLUP] = 9,
+	[LOG_LEAF_REDIRECT] = 13,
+	[LOG_BNODE_REDIRECT] = 13,
+	[LOG_BNODE_ROOT] = 26,
+	[LOG_BNODE_SPLIT] = 15,
+	[LOG_BNODE_ADD] = 19,
+	[LOG_BNODE_UPDATE] = 19,
+	[LOG_REDIRECT_PATH] = 8,
+};
+
+/* Record size, LOG_REDIRECT_PATH carries one old block per level */
+unsigned log_recsize(const unsigned char *rec)
+{
+	if (*rec == LOG_REDIRECT_PATH)
+		return logsize[LOG_REDIRECT_PATH] + 6 * rec[1];
+	return logsize[*rec];
+}
+
 void log_next(struct sb *sb)
 {
 	sb->logbuf = blockget(mapping(sb->logmap), sb->lognext++);
-	sb->logpos = bufdata(sb->logbuf) + sizeof(struct logblock);
 	sb->logtop = bufdata(sb->logbuf) + sb->blocksize;
+	/* publish logpos last, log_reserve() reads it first */
+	smp_wmb();
+	sb->logpos = bufdata(sb->logbuf) + sizeof(struct logblock);
 }
 
 void log_drop(struct sb *sb)
@@ -78,42 +106,98 @@ void log_drop(struct sb *sb)
 	sb->logtop = sb->logpos = NULL;
 }
 
+/*
+ * Close the current log block.  Once logpos is cleared nobody can reserve
+ * in it, and only one block is open at a time, so the writers counted in
+ * sb->log_writers are all filling this block; wait for them to finish
+ * before the block is sealed and our reference dropped.
+ *
+ * Must hold sb->loglock.  The slow path of log_begin() closes and opens
+ * blocks under it, and nothing else serializes the two: the backend logs
+ * frees and allocations while it flushes a delta.
+ */
 void log_finish(struct sb *sb)
 {
 	if (sb->logbuf) {
 		struct logblock *log = bufdata(sb->logbuf);
-		assert(sb->logtop >= sb->logpos);
-		log->bytes = to_be_u16(sb->logpos - log->data);
-		memset(sb->logpos, 0, sb->logtop - sb->logpos);
+		/* close the block, later reservations go to the slow path */
+		unsigned char *pos = xchg(&sb->logpos, NULL);
+		assert(sb->logtop >= pos);
+#ifdef __KERNEL__
+		while (atomic_read(&sb->log_writers))
+			cpu_relax();
+#else
+		/* single threaded, every log_begin() has its log_end() by now */
+		assert(!atomic_read(&sb->log_writers));
+#endif
+		log->bytes = to_be_u16(pos - log->data);
+		memset(pos, 0, sb->logtop - pos);
 		log_drop(sb);
 	}
 }
 
+/*
+ * Claim @bytes in the current log block by advancing sb->logpos with
+ * cmpxchg.  Returns NULL if there is no block or it is full.  A writer
+ * is counted in sb->log_writers from before it looks at logpos until
+ * log_end(), so log_finish() can not seal the block under it.
+ */
+static void *log_reserve(struct sb *sb, unsigned bytes)
+{
+	unsigned char *pos, *top;
+
+	atomic_inc(&sb->log_writers);
+	smp_mb__after_atomic_inc();
+	do {
+		pos = sb->logpos;
+		smp_rmb();
+		top = sb->logtop;
+		if (!pos || pos + bytes > top) {
+			atomic_dec(&sb->log_writers);
+			return NULL;
+		}
+	} while (cmpxchg(&sb->logpos, pos, pos + bytes) != pos);
+
+	return pos;
+}
+
+/*
+ * Log writers only serialize on sb->loglock when the current log block
+ * is full and the next one has to be started.  Every log_begin() must be
+ * paired with log_end() once the record is written.
+ */
 void *log_begin(struct sb *sb, unsigned bytes)
 {
+	unsigned char *pos = log_reserve(sb, bytes);
+
+	if (pos)
+		return pos;
+	assert(sizeof(struct logblock) + bytes <= sb->blocksize);
 	mutex_lock(&sb->loglock);
-	if (sb->logpos + bytes > sb->logtop) {
+	while (!(pos = log_reserve(sb, bytes))) {
 		log_finish(sb);
 		log_next(sb);
 		*(struct logblock *)bufdata(sb->logbuf) = (struct logblock){
 			.magic = to_be_u16(TUX3_MAGIC_LOG) };
 	}
-	return sb->logpos;
+	mutex_unlock(&sb->loglock);
+	return pos;
 }
 
+/* The record is written into the reserved space, let log_finish() go */
 void log_end(struct sb *sb, void *pos)
 {
-	sb->logpos = pos;
-	mutex_unlock(&sb->loglock);
+	smp_mb__before_atomic_dec();
+	atomic_dec(&sb->log_writers);
 }
 
 static void log_extent(struct sb *sb, u8 intent, block_t block, unsigned count)
 {
-	assert(count < 256);	/* FIXME: extent max is 64 for now */
-	unsigned char *data = log_begin(sb, 8);
+	assert(count <= MAX_EXTENT);
+	unsigned char *data = log_begin(sb, 9);
 
 	*data++ = intent;
-	*data++ = count;
+	data = encode16(data, count);
 	log_end(sb, encode48(data, block));
 }
 
@@ -151,6 +235,20 @@ void log_bnode_redirect(struct sb *sb, block_t oldblock, block_t newblock)
 	log_redirect(sb, LOG_BNODE_REDIRECT, oldblock, newblock);
 }
 
+/* Level i (the leaf first) moved from @oldblocks[i] to @newbase + i */
+void log_redirect_path(struct sb *sb, block_t newbase, block_t *oldblocks, unsigned levels)
+{
+	unsigned char *data = log_begin(sb, logsize[LOG_REDIRECT_PATH] + 6 * levels);
+
+	assert(levels <= 0xff);
+	*data++ = LOG_REDIRECT_PATH;
+	*data++ = levels;
+	data = encode48(data, newbase);
+	for (unsigned i = 0; i < levels; i++)
+		data = encode48(data, oldblocks[i]);
+	log_end(sb, data);
+}
+
 /* The left key should always be 0 on new root */
 void log_bnode_root(struct sb *sb, block_t root, unsigned count,
 		    block_t left, block_t right, tuxkey_t rkey)
@@ -196,6 +294,111 @@ void log_bnode_update(struct sb *sb, block_t parent, block_t child, tuxkey_t key
 	log_bnode_entry(sb, LOG_BNODE_UPDATE, parent, child, key);
 }
 
+/*
+ * Log compaction, at delta transition when no more records can arrive:
+ * merge runs of adjacent extent records with the same intent (one big
+ * write or truncate logs one record per extent), then repack log blocks
+ * [start, end) so the delta writes as few log blocks as possible.
+ * Merged extents stay inside one bitmap block, as replay expects.
+ * Surviving records are charged to sb->cycle_cost.  Returns the new end.
+ */
+static int log_merge_extent(struct sb *sb, unsigned char *last, unsigned char *rec)
+{
+	unsigned mapshift = sb->blockbits + 3;
+	unsigned count1, count2;
+	u64 block1, block2;
+
+	if (*last != *rec)
+		return 0;
+	decode48(decode16(last + 1, &count1), &block1);
+	decode48(decode16(rec + 1, &count2), &block2);
+	if (count1 + count2 > 0xffff)
+		return 0;
+	if (block2 + count2 == block1)
+		block1 = block2;
+	else if (block1 + count1 != block2)
+		return 0;
+	if (block1 >> mapshift != (block1 + count1 + count2 - 1) >> mapshift)
+		return 0;
+	encode48(encode16(last + 1, count1 + count2), block1);
+	return 1;
+}
+
+/* Charge a record to the replay cost of this rollup cycle */
+static void log_account(struct sb *sb, unsigned char *rec)
+{
+	struct replay_cost *cost = &sb->cycle_cost;
+
+	cost->records++;
+	if (*rec == LOG_BALLOC || *rec == LOG_BFREE || *rec == LOG_BFREE_ON_ROLLUP) {
+		u64 block;
+		decode48(rec + 3, &block);
+		unsigned hash = ((block >> (sb->blockbits + 3)) * 0x9e37fffffffc0001ULL) >> 56;
+		cost->maps[hash >> 3] |= 1 << (hash & 7);
+	}
+}
+
+unsigned log_compact(struct sb *sb, unsigned start, unsigned end)
+{
+	unsigned room = sb->blocksize - sizeof(struct logblock);
+	unsigned char *vec, *top, *last = NULL, *data;
+	unsigned index;
+
+	if (end - start < 1)
+		return end;
+	if (!(top = vec = malloc((end - start) * room)))
+		return end;
+
+	/* Gather and merge */
+	for (index = start; index < end; index++) {
+		struct buffer_head *buffer = blockget(mapping(sb->logmap), index);
+		if (!buffer) {
+			free(vec);
+			return end;
+		}
+		struct logblock *log = bufdata(buffer);
+		unsigned char *limit = log->data + from_be_u16(log->bytes);
+		for (data = log->data; data < limit; data += log_recsize(data)) {
+			switch (*data) {
+			case LOG_BALLOC:
+			case LOG_BFREE:
+			case LOG_BFREE_ON_ROLLUP:
+				if (last && log_merge_extent(sb, last, data))
+					continue;
+				last = top;
+				break;
+			default:
+				last = NULL;
+			}
+			memcpy(top, data, log_recsize(data));
+			top += log_recsize(data);
+		}
+		blockput(buffer);
+	}
+
+	/* Repack */
+	index = start;
+	for (data = vec; data < top || index == start; index++) {
+		struct buffer_head *buffer = blockget(mapping(sb->logmap), index);
+		assert(buffer); /* we had them all just above */
+		struct logblock *log = bufdata(buffer);
+		unsigned char *pos = log->data;
+		while (data < top && pos + log_recsize(data) <= log->data + room) {
+			unsigned size = log_recsize(data);
+			log_account(sb, data);
+			memcpy(pos, data, size);
+			pos += size;
+			data += size;
+		}
+		log->bytes = to_be_u16(pos - log->data);
+		memset(pos, 0, log->data + room - pos);
+		blockput(buffer);
+	}
+	free(vec);
+	trace("compacted log blocks %u-%u to %u-%u", start, end, start, index);
+	return index;
+}
+
 /* Stash infrastructure (struct stash must be initialized by zero clear) */
 
 /*
@@ -214,11 +417,52 @@ static void stash_init(struct stash *stash)
 	stash->pos = stash->top = NULL;
 }
 
+/*
+ * Stash pages come from a per-sb pool, so deferred free bookkeeping does
+ * not allocate once the pool has grown to the steady state working set.
+ */
+static struct page *stash_page_alloc(struct sb *sb)
+{
+	struct page *page = NULL;
+
+	spin_lock(&sb->stash_lock);
+	if (!link_empty(&sb->stash_pool)) {
+		page = link_entry((unsigned long *)sb->stash_pool.next, struct page, private);
+		link_del_next(&sb->stash_pool);
+		sb->stash_pool_pages--;
+	}
+	spin_unlock(&sb->stash_lock);
+	return page ? : alloc_page(GFP_NOFS);
+}
+
+static void stash_page_free(struct sb *sb, struct page *page)
+{
+	spin_lock(&sb->stash_lock);
+	if (sb->stash_pool_pages < STASH_POOL_PAGES) {
+		link_add(page_link(page), &sb->stash_pool);
+		sb->stash_pool_pages++;
+		page = NULL;
+	}
+	spin_unlock(&sb->stash_lock);
+	if (page)
+		__free_page(page);
+}
+
+void destroy_stash_pool(struct sb *sb)
+{
+	while (!link_empty(&sb->stash_pool)) {
+		struct page *page = link_entry((unsigned long *)sb->stash_pool.next, struct page, private);
+		link_del_next(&sb->stash_pool);
+		__free_page(page);
+	}
+	sb->stash_pool_pages = 0;
+}
+
 /* Add new entry (value) to stash */
-int stash_value(struct stash *stash, u64 value)
+int stash_value(struct sb *sb, struct stash *stash, u64 value)
 {
 	if (stash->pos == stash->top) {
-		struct page *page = alloc_page(GFP_NOFS);
+		struct page *page = stash_page_alloc(sb);
 		if (!page)
 			return -ENOMEM;
 		stash->top = page_address(page) + PAGE_SIZE;
@@ -232,8 +476,8 @@ int stash_value(struct stash *stash, u64 value)
 	return 0;
 }
 
-/* Free all pages in stash to empty. */
-static void empty_stash(struct stash *stash)
+/* Give all pages in stash back to the pool to empty it. */
+static void empty_stash(struct sb *sb, struct stash *stash)
 {
 	struct flink_head *head = &stash->head;
 
@@ -244,9 +488,9 @@ static void empty_stash(struct stash *stash)
 			if (flink_is_last(head))
 				break;
 			flink_del_next(head);
-			__free_page(page);
+			stash_page_free(sb, page);
 		}
-		__free_page(page);
+		stash_page_free(sb, page);
 		stash_init(stash);
 	}
 }
@@ -274,20 +518,85 @@ int unstash(struct sb *sb, struct stash *stash, unstash_t actor)
 		if (flink_is_last(head))
 			break;
 		flink_del_next(head);
-		__free_page(page);
+		stash_page_free(sb, page);
 	}
 	stash->pos = page_address(page);
 	return 0;
 }
 
+/*
+ * Like unstash(), but gather all entries into one vector and call actor()
+ * once, so it can sort and coalesce them.  If the vector cannot be
+ * allocated, fall back to calling actor() on each page in place.
+ */
+int unstash_vec(struct sb *sb, struct stash *stash, unstash_vec_t actor)
+{
+	struct flink_head *head = &stash->head;
+	unsigned count = 0;
+	struct page *page;
+	u64 *all;
+	int err;
+
+	if (flink_empty(head))
+		return 0;
+	/* Count entries: every page is full except the last one */
+	struct link *link = flink_next(head);
+	while (1) {
+		page = link_entry((unsigned long *)link, struct page, private);
+		if (link == head->tail) {
+			count += stash->pos - (u64 *)page_address(page);
+			break;
+		}
+		count += PAGE_SIZE / sizeof(u64);
+		link = link->next;
+	}
+
+	all = malloc(count * sizeof(*all));
+	u64 *pos = all;
+	while (1) {
+		page = __flink_next_entry(head, struct page, private);
+		u64 *vec = page_address(page), *top = page_address(page) + PAGE_SIZE;
+		if (top == stash->top)
+			top = stash->pos;
+		if (all) {
+			memcpy(pos, vec, (top - vec) * sizeof(*vec));
+			pos += top - vec;
+		} else if (top > vec && (err = actor(sb, vec, top - vec)))
+			return err;
+		if (flink_is_last(head))
+			break;
+		flink_del_next(head);
+		stash_page_free(sb, page);
+	}
+	stash->pos = page_address(page);
+	if (!all)
+		return 0;
+	err = count ? actor(sb, all, count) : 0;
+	free(all);
+	return err;
+}
+
 /* Deferred free blocks list */
 
-int defer_bfree(struct stash *defree, block_t block, unsigned count)
+/*
+ * An extent that continues the last one in the stash extends it in place,
+ * so freeing a long run one block at a time takes one entry.
+ */
+int defer_bfree(struct sb *sb, struct stash *defree, block_t block, unsigned count)
 {
-	return stash_value(defree, ((u64)count << 48) + block);
+	if (defree->pos && defree->pos > defree->top - PAGE_SIZE / sizeof(u64)) {
+		u64 last = defree->pos[-1];
+		block_t lastblock = last & ~(-1ULL << 48);
+		unsigned lastcount = last >> 48;
+		if (lastblock + lastcount == block && lastcount + count <= MAX_EXTENT) {
+			defree->pos[-1] = ((u64)(lastcount + count) << 48) + lastblock;
+			return 0;
+		}
+	}
+	return stash_value(sb, defree, ((u64)count << 48) + block);
 }
 
-void destroy_defer_bfree(struct stash *defree)
+void destroy_defer_bfree(struct sb *sb, struct stash *defree)
 {
-	empty_stash(defree);
+	empty_stash(sb, defree);
 }
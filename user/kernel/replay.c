@@ -8,114 +8,226 @@
 #define trace trace_on
 #endif
 
-static unsigned logsize[LOG_TYPES] = {
-	[LOG_BALLOC] = 8,
-	[LOG_BFREE] = 8,
-	[LOG_BFREE_ON_ROLLUP] = 8,
-	[LOG_LEAF_REDIRECT] = 13,
-	[LOG_BNODE_REDIRECT] = 13,
-	[LOG_BNODE_ROOT] = 26,
-	[LOG_BNODE_SPLIT] = 15,
-	[LOG_BNODE_ADD] = 19,
-	[LOG_BNODE_UPDATE] = 19,
+/* One bitmap update from the log, seq keeps log order within a bitmap block */
+struct replay_extent {
+	block_t block, mapblock;
+	unsigned count, seq;
+	int set;
 };
 
-int replay(struct sb *sb)
+static int cmp_replay_extent(const void *a, const void *b)
 {
-	block_t logchain = sb->logchain;
-	unsigned logcount = from_be_u32(sb->super.logcount);
+	const struct replay_extent *x = a, *y = b;
 
-	trace("load %u logblocks", logcount);
-	for (int i = logcount; i-- > 0;) {
-		struct buffer_head *buffer = blockget(mapping(sb->logmap), i);
-		if (!buffer)
-			return -ENOMEM;
-		int err = blockio(0, buffer, logchain);
-		if (err) {
-			blockput(buffer);
-			return err;
+	if (x->mapblock != y->mapblock)
+		return x->mapblock < y->mapblock ? -1 : 1;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/*
+ * Apply the bitmap updates of the whole log, grouped by bitmap block so
+ * each bitmap block is read and dirtied once.
+ */
+static int replay_bitmap(struct sb *sb, struct replay_extent *vec, unsigned count)
+{
+	unsigned mapshift = sb->blockbits + 3, mapmask = (1 << mapshift) - 1;
+	struct buffer_head *buffer = NULL;
+	block_t mapblock = -1;
+
+	for (unsigned i = 0; i < count; i++)
+		vec[i].mapblock = vec[i].block >> mapshift;
+	sort(vec, count, sizeof(*vec), cmp_replay_extent, NULL);
+
+	for (unsigned i = 0; i < count; i++) {
+		struct replay_extent *extent = vec + i;
+		unsigned offset = extent->block & mapmask;
+		if (extent->mapblock != mapblock) {
+			if (buffer)
+				blockput_dirty(buffer);
+			mapblock = extent->mapblock;
+			if (!(buffer = blockread(mapping(sb->bitmap), mapblock)))
+				return -ENOMEM;
 		}
-		struct logblock *log = bufdata(buffer);
-		if (log->magic != to_be_u16(TUX3_MAGIC_LOG)) {
-			warn("bad log magic %x", from_be_u16(log->magic));
+		trace("%s bits 0x%Lx/%x", extent->set ? "set" : "clear",
+		      (L)extent->block, extent->count);
+		if (!(extent->set ? all_clear : all_set)(bufdata(buffer), offset, extent->count)) {
+			warn("bitmap update out of sync: 0x%Lx/%x",
+			     (L)extent->block, extent->count);
 			blockput(buffer);
 			return -EINVAL;
 		}
-		logchain = from_be_u64(log->logchain);
-		blockput(buffer);
+		/* sb->freeblocks is from the super, it already counts these */
+		(extent->set ? set_bits : clear_bits)(bufdata(buffer), offset, extent->count);
 	}
+	if (buffer)
+		blockput_dirty(buffer);
+	return 0;
+}
 
-	unsigned code;
-	for (sb->lognext = 0; sb->lognext < logcount;) {
-		trace("log block %i", sb->lognext);
-		log_next(sb);
-		struct logblock *log = bufdata(sb->logbuf);
-		unsigned char *data = log->data;
-		while (data < log->data + from_be_u16(log->bytes)) {
-			switch (code = *data++) {
-			case LOG_BNODE_ADD:
-			case LOG_BNODE_UPDATE:
-			{
-				u64 child, parent, key;
-				data = decode48(data, &parent);
-				data = decode48(data, &child);
-				data = decode48(data, &key);
-				trace("parent = 0x%Lx, child = 0x%Lx, key = 0x%Lx", (L)parent, (L)child, (L)key);
+/* Read the log chain into logmap, each contiguous run with one I/O */
+static int replay_load(struct sb *sb, unsigned logcount)
+{
+	u64 logchain = sb->logchain;
+	struct buffer_head *buffers[64];
+
+	trace("load %u logblocks", logcount);
+	for (unsigned i = logcount; i > 0;) {
+		unsigned count = min_t(unsigned, logchain_count(logchain), i);
+		count = min_t(unsigned, count, ARRAY_SIZE(buffers));
+		block_t block = logchain_block(logchain) - (count - 1);
+		unsigned got;
+		int err = 0;
+
+		i -= count;
+		for (got = 0; got < count; got++) {
+			buffers[got] = blockget(mapping(sb->logmap), i + got);
+			if (!buffers[got]) {
+				err = -ENOMEM;
 				break;
 			}
-			case LOG_BALLOC:
-			case LOG_BFREE:
-			case LOG_BFREE_ON_ROLLUP:
-				data += logsize[code] - 1;
-				break;
-			case LOG_LEAF_REDIRECT:
-			case LOG_BNODE_REDIRECT:
-			case LOG_BNODE_ROOT:
-			case LOG_BNODE_SPLIT:
-			default:
-				goto unknown;
+		}
+		if (!err)
+			err = blockio_vec(0, buffers, count, block);
+		for (unsigned j = 0; !err && j < count; j++) {
+			struct logblock *log = bufdata(buffers[j]);
+			if (log->magic != to_be_u16(TUX3_MAGIC_LOG)) {
+				warn("bad log magic %x", from_be_u16(log->magic));
+				err = -EINVAL;
 			}
 		}
-		log_drop(sb);
+		if (!err)
+			logchain = from_be_u64(((struct logblock *)bufdata(buffers[0]))->logchain);
+		while (got--)
+			blockput(buffers[got]);
+		if (err)
+			return err;
 	}
+	return 0;
+}
+
+/*
+ * Replay the log: load the chain, then decode every record in one pass.
+ * Bitmap updates since the last rollup are collected and applied grouped
+ * by bitmap block.  Any that does not fit the bitmap is an error.
+ *
+ * FIXME: btree records are decoded but pinned bnodes are not yet
+ * reconstructed from them.
+ */
+int replay(struct sb *sb)
+{
+	unsigned logcount = from_be_u32(sb->super.logcount);
+	unsigned room = sb->blocksize - sizeof(struct logblock);
+	struct replay_extent *vec;
+	unsigned extents = 0, code;
+	int err;
+
+	if ((err = replay_load(sb, logcount)))
+		return err;
+	/* the smallest record is an extent, so this is an upper bound */
+	vec = malloc(max(logcount * (room / logsize[LOG_BALLOC]), 1U) * sizeof(*vec));
+	if (!vec)
+		return -ENOMEM;
+
+	/* the bitmap written by the last rollup has the old cycle in it */
+	unsigned oldcount = logcount - from_be_u32(sb->super.next_logcount);
 
 	for (sb->lognext = 0; sb->lognext < logcount;) {
-		trace("log block %i", sb->lognext);
+		int old = sb->lognext < oldcount;
+		trace("log block %i%s", sb->lognext, old ? ", old cycle" : "");
 		log_next(sb);
 		struct logblock *log = bufdata(sb->logbuf);
 		unsigned char *data = log->data;
-		while (data < log->data + from_be_u16(log->bytes)) {
-			switch (code = *data++) {
+		unsigned char *limit = log->data + from_be_u16(log->bytes);
+		while (data < limit) {
+			code = *data++;
+			if (code < LOG_BALLOC || code >= LOG_TYPES ||
+			    data - 1 + logsize[code] > limit ||
+			    data - 1 + log_recsize(data - 1) > limit)
+				goto unknown;
+			switch (code) {
 			case LOG_BALLOC:
 			case LOG_BFREE:
 			case LOG_BFREE_ON_ROLLUP:
 			{
 				u64 block;
-				unsigned count = *data++;
+				unsigned count;
+				data = decode16(data, &count);
 				data = decode48(data, &block);
-				trace("%s bits 0x%Lx/%x", code == LOG_BALLOC ? "set" : "clear", (L)block, count);
-				int err = update_bitmap(sb, block, count, code == LOG_BALLOC);
-				warn(">>> bitmap err = %i", err);
+				if (old)
+					break;
+				vec[extents] = (struct replay_extent){
+					.block = block,
+					.count = count,
+					.seq = extents,
+					.set = code == LOG_BALLOC,
+				};
+				extents++;
 				break;
 			}
 			case LOG_LEAF_REDIRECT:
 			case LOG_BNODE_REDIRECT:
+			{
+				u64 oldblock, newblock;
+				data = decode48(data, &oldblock);
+				data = decode48(data, &newblock);
+				trace("redirect 0x%Lx -> 0x%Lx", (L)oldblock, (L)newblock);
+				break;
+			}
+			case LOG_REDIRECT_PATH:
+			{
+				u64 newbase, oldblock;
+				unsigned levels = *data++;
+				data = decode48(data, &newbase);
+				for (unsigned i = 0; i < levels; i++) {
+					data = decode48(data, &oldblock);
+					trace("redirect level %u 0x%Lx -> 0x%Lx",
+					      i, (L)oldblock, (L)newbase + i);
+				}
+				break;
+			}
 			case LOG_BNODE_ROOT:
+			{
+				u64 root, left, right, rkey;
+				unsigned count = *data++;
+				data = decode48(data, &root);
+				data = decode48(data, &left);
+				data = decode48(data, &right);
+				data = decode48(data, &rkey);
+				trace("root 0x%Lx, %u entries: 0x%Lx, 0x%Lx/0x%Lx",
+				      (L)root, count, (L)left, (L)right, (L)rkey);
+				break;
+			}
 			case LOG_BNODE_SPLIT:
+			{
+				u64 src, dest;
+				unsigned pos;
+				data = decode32(data, &pos);
+				data = decode48(data, &src);
+				data = decode48(data, &dest);
+				trace("split 0x%Lx at %u -> 0x%Lx", (L)src, pos, (L)dest);
+				break;
+			}
 			case LOG_BNODE_ADD:
 			case LOG_BNODE_UPDATE:
-				data += logsize[code] - 1;
+			{
+				u64 child, parent, key;
+				data = decode48(data, &parent);
+				data = decode48(data, &child);
+				data = decode48(data, &key);
+				trace("parent = 0x%Lx, child = 0x%Lx, key = 0x%Lx", (L)parent, (L)child, (L)key);
 				break;
-			default:
-				goto unknown;
+			}
 			}
 		}
 		log_drop(sb);
 	}
 
-	return 0;
+	err = replay_bitmap(sb, vec, extents);
+	free(vec);
+	return err;
 unknown:
-	warn("unrecognized log code 0x%x, 0x%x", code, LOG_BNODE_UPDATE);
+	warn("unrecognized log code 0x%x", code);
 	log_drop(sb);
+	free(vec);
 	return -EINVAL;
 }
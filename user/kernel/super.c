@@ -6,6 +6,7 @@
 
 #include <linux/module.h>
 #include <linux/statfs.h>
+#include <linux/seq_file.h>
 #include "tux3.h"
 
 /* This will go to include/linux/magic.h */
@@ -54,6 +55,7 @@ static struct inode *tux3_alloc_inode(struct super_block *sb)
 	tuxi->btree = (struct btree){ };
 	tuxi->present = 0;
 	tuxi->xcache = NULL;
+	tuxi->reserved = 0;
 
 	/* uninitialized stuff by alloc_inode() */
 	tuxi->vfs_inode.i_version = 1;
@@ -86,10 +88,11 @@ static void tux3_put_super(struct super_block *sb)
 	/* FIXME: remove this, then use sb->s_dirt instead */
 	tux3_write_super(sb);
 
-	destroy_defer_bfree(&sbi->new_decycle);
-	destroy_defer_bfree(&sbi->decycle);
-	destroy_defer_bfree(&sbi->derollup);
-	destroy_defer_bfree(&sbi->defree);
+	destroy_defer_bfree(sbi, &sbi->new_decycle);
+	destroy_defer_bfree(sbi, &sbi->decycle);
+	destroy_defer_bfree(sbi, &sbi->derollup);
+	destroy_defer_bfree(sbi, &sbi->defree);
+	destroy_stash_pool(sbi);
 	iput(sbi->atable);
 	iput(sbi->bitmap);
 	iput(sbi->volmap);
@@ -122,6 +125,16 @@ static int tux3_statfs(struct dentry *dentry, struct kstatfs *buf)
 	return 0;
 }
 
+/* Commit counters, for /proc/self/mountstats */
+static int tux3_show_stats(struct seq_file *seq, struct vfsmount *mnt)
+{
+	char buf[256];
+
+	format_delta_stats(tux_sb(mnt->mnt_sb), buf, sizeof(buf));
+	seq_puts(seq, buf);
+	return 0;
+}
+
 static const struct super_operations tux3_super_ops = {
 	.alloc_inode	= tux3_alloc_inode,
 	.destroy_inode	= tux3_destroy_inode,
@@ -131,6 +144,7 @@ static const struct super_operations tux3_super_ops = {
 	.write_super	= tux3_write_super,
 	.put_super	= tux3_put_super,
 	.statfs		= tux3_statfs,
+	.show_stats	= tux3_show_stats,
 };
 
 static int tux3_fill_super(struct super_block *sb, void *data, int silent)
@@ -149,6 +163,10 @@ static int tux3_fill_super(struct super_block *sb, void *data, int silent)
 	sb->s_time_gran = 1;
 
 	mutex_init(&sbi->loglock);
+	mutex_init(&sbi->commit_lock);
+	spin_lock_init(&sbi->stash_lock);
+	init_link_circular(&sbi->stash_pool);
+	sbi->policy = (struct commit_policy)INIT_COMMIT_POLICY;
 	INIT_LIST_HEAD(&sbi->alloc_inodes);
 
 	err = -EIO;
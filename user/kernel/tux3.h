@@ -11,6 +11,7 @@
 #include <linux/bio.h>
 #include <linux/mutex.h>
 #include <linux/magic.h>
+#include <linux/sort.h>
 
 typedef loff_t block_t;
 
@@ -34,6 +35,7 @@ typedef u64 fixed32; /* Tux3 time values */
 typedef u32 millisecond_t;
 typedef u64 inum_t;
 typedef u64 tuxkey_t;
+#define TUXKEY_LIMIT ((tuxkey_t)~0ULL)
 
 #ifdef __KERNEL__
 /* Endian support */
@@ -125,7 +127,9 @@ static inline void *decode48(void *at, u64 *val)
 
 /* Tux3 disk format */
 
-#define TUX3_MAGIC		"tux3" "\xdd\x09\x03\x10"
+#define TUX3_MAGIC		"tux3" "\xdd\x26\x10\x18"
+/* Previous format, load_sb upgrades it in place if its log is empty */
+#define TUX3_MAGIC_20090310	"tux3" "\xdd\x09\x03\x10"
 /*
  * TUX3_LABEL includes the date of the last incompatible disk format change
  * NOTE: Always update this history for each incompatible change!
@@ -137,17 +141,20 @@ static inline void *decode48(void *at, u64 *val)
  * 2008-12-12: Atom dictionary size in disksuper instead of atable->i_size
  * 2009-02-28: Attributes renumbered, rdev added
  * 2009-03-10: Alignment fix of disksuper
+ * 2026-10-18: Extent count widened to 15 bits (dleaf2), 16 bit log extent count,
+ *             log chain pointers carry a run count
  */
 
 #define TUX3_MAGIC_LOG		0x10ad
-#define TUX3_MAGIC_DLEAF	0x1eaf
+#define TUX3_MAGIC_DLEAF	0x1eaf	/* count:6 extents, converted on write */
+#define TUX3_MAGIC_DLEAF2	0x2eaf
 #define TUX3_MAGIC_ILEAF	0x90de
 
 #define MAX_INODES_BITS 48
 #define MAX_BLOCKS_BITS 48
 #define MAX_FILESIZE_BITS 60
 #define MAX_FILESIZE (1LL << MAX_FILESIZE_BITS)
-#define MAX_EXTENT (1 << 6)
+#define MAX_EXTENT (1 << 15)
 #define SB_LOC (1 << 12)
 #define SB_LEN (1 << 12)	/* this is maximum blocksize */
 
@@ -185,12 +192,55 @@ struct root {
 	block_t block; /* disk location of btree root */
 };
 
+/*
+ * Path of the last probe, so the next probe for a key in the same leaf
+ * can skip the index searches.  Dropped whenever the index changes.
+ */
+#define FINGER_LEVELS 8
+
+/* Leaves a range scan keeps in flight */
+#define SCAN_READAHEAD 8
+
+/* Bottom-up btree build from leaves in key order, see bulk_begin() */
+#define BULK_LEVELS 8
+
+struct bulk_load {
+	struct btree *btree;
+	struct buffer_head *leaf; /* Leaf the caller is filling */
+	struct buffer_head *node[BULK_LEVELS]; /* Index node being filled, per level up */
+	unsigned levels;	/* Index levels started */
+	block_t block, total;	/* Extent allocated for the whole tree */
+	block_t leafnext, nodenext, nodebase; /* Next free leaf and node blocks */
+	int err;		/* First error, bulk_end() then frees the extent */
+};
+
+/* Btree shape and health, see btree_stats() */
+#define STATS_FILL_BUCKETS 10
+
+struct btree_stats {
+	unsigned depth;		/* Deepest tree seen */
+	block_t nodes, leaves;
+	block_t entries;	/* Index entries in all nodes */
+	block_t cached;		/* Blocks found in cache before the walk read them */
+	block_t jumps;		/* Leaves not physically after the previous leaf */
+	block_t fill[STATS_FILL_BUCKETS]; /* Leaves by tenths of space used */
+};
+
+struct btree_finger {
+	spinlock_t lock;	/* probe() only holds btree->lock for read */
+	unsigned depth;		/* Levels cached, 0 if none */
+	tuxkey_t start, limit;	/* Key range of the leaf */
+	block_t block[FINGER_LEVELS + 1]; /* Index nodes, then the leaf */
+	unsigned at[FINGER_LEVELS]; /* Cursor ->next offset in each node */
+};
+
 struct btree {
 	struct rw_semaphore lock;
 	struct sb *sb;		/* Convenience to reduce parameter list size */
 	struct btree_ops *ops;	/* Generic btree low level operations */
 	struct root root;	/* Cached description of btree root */
 	u16 entries_per_leaf;	/* Used in btree leaf splitting */
+	struct btree_finger finger; /* Last probed path */
 };
 
 /* Define layout of btree root on disk, endian conversion is elsewhere. */
@@ -224,6 +274,66 @@ struct cursor {
 
 struct stash { struct flink_head head; u64 *pos, *top; };
 
+/* Free stash pages kept per sb for reuse, the rest go back to the system */
+#define STASH_POOL_PAGES 64
+
+/*
+ * When to commit a delta and when to roll up the log.  A delta commits
+ * as soon as any of its triggers is reached, zero disables a trigger.
+ */
+struct commit_policy {
+	unsigned changes;	/* Frontend changes in the delta */
+	unsigned dirty_blocks;	/* Dirty data blocks awaiting allocation */
+	unsigned log_blocks;	/* Log blocks written by the delta */
+	unsigned interval;	/* Seconds since the previous commit */
+	unsigned rollup_deltas;	/* Deltas since the previous rollup */
+	unsigned replay_budget;	/* Estimated mount-time replay cost, in block reads */
+};
+
+#define INIT_COMMIT_POLICY {						\
+	.changes = 10,							\
+	.dirty_blocks = 1024,						\
+	.log_blocks = 64,						\
+	.interval = 5,							\
+	.rollup_deltas = 0,						\
+	.replay_budget = 256,						\
+}
+
+/*
+ * What it would cost to replay one rollup cycle of the log at mount, on
+ * top of reading its log blocks.  Bitmap blocks are hashed into a small
+ * bitmap, so the distinct count is an estimate that saturates at 256.
+ */
+struct replay_cost {
+	unsigned records;	/* Log records */
+	unsigned char maps[32];	/* Bitmap blocks updated */
+};
+
+/* Replaying this many records costs about as much as one block read */
+#define REPLAY_RECORDS_PER_READ 64
+
+/* Why a delta was committed */
+enum { COMMIT_FORCE, COMMIT_CHANGES, COMMIT_DIRTY, COMMIT_LOG, COMMIT_INTERVAL, COMMIT_REASONS };
+
+struct delta_stats {
+	unsigned delta;		/* Delta number */
+	unsigned reason;	/* COMMIT_* trigger */
+	unsigned changes;	/* Frontend changes in the delta */
+	unsigned log_blocks;	/* Log blocks written by the delta */
+	block_t dirty_blocks;	/* Dirty data blocks at commit */
+	int rollup;		/* Log was rolled up by this delta */
+	unsigned replay_cost;	/* Estimated replay cost at commit */
+	unsigned usecs;		/* Time taken to commit */
+};
+
+/* Super fields as of a delta transition, see snapshot_sb() */
+struct sb_snapshot {
+	u64 iroot;
+	block_t freeblocks, nextalloc;
+	unsigned atomgen, freeatom;
+	loff_t dictsize;
+};
+
 /* Tux3-specific sb is a handle for the entire volume state */
 
 struct sb {
@@ -239,10 +349,22 @@ struct sb {
 	struct inode *vtable;	/* version table special file */
 	struct inode *atable;	/* xattr atom special file */
 	unsigned delta;		/* delta commit cycle */
+	unsigned committed;	/* deltas before this one are on disk */
+	int commit_err;		/* error of the first delta that failed to commit */
 	unsigned rollup;	/* log rollup cycle */
 	struct rw_semaphore delta_lock; /* delta transition exclusive */
+	struct mutex commit_lock; /* serialize delta flush in backend */
+	struct commit_policy policy; /* delta commit and rollup triggers */
+	atomic_t delta_changes;	/* frontend changes in this delta */
+	struct timespec delta_start; /* time this delta began */
+	unsigned rollup_delta;	/* delta of previous log rollup */
+	struct replay_cost cycle_cost, prev_cost; /* this and previous rollup cycle */
+	struct delta_stats last_delta; /* stats of last committed delta */
+	unsigned long commits[COMMIT_REASONS]; /* committed deltas, by reason */
 	unsigned blocksize, blockbits, blockmask;
 	block_t volblocks, freeblocks, nextalloc;
+	block_t reserved;	/* Blocks reserved by delayed allocation */
+	unsigned discard;	/* Discard extents as they are freed */
 	unsigned entries_per_node; /* must be per-btree type, get rid of this */
 	unsigned max_inodes_per_block; /* get rid of this and use entries per leaf */
 	unsigned version;	/* Currently mounted volume version view */
@@ -252,18 +374,22 @@ struct sb {
 	loff_t dictsize;	/* Atom dictionary size */
 
 	struct inode *logmap;	/* Log block cache */
-	block_t logchain;	/* Previous log block physical address */
+	u64 logchain;		/* Previous log block, logchain_ptr() */
 	unsigned logbase;	/* Index of oldest log block in log map */
 	unsigned next_logbase;	/* ->logbase for the next cycle */
 	unsigned logthis;	/* Index of first log block in delta */
 	unsigned lognext;	/* Index of next log block in log map */
 	struct buffer_head *logbuf; /* Cached log block */
 	unsigned char *logpos, *logtop; /* Where to emit next log entry */
-	struct mutex loglock;	/* serialize log entries (spinlock me) */
+	struct mutex loglock;	/* serialize switching to next log block */
+	atomic_t log_writers;	/* writers still filling a reservation */
 	struct stash defree;	/* defer extent frees until after commit */
 	struct stash derollup;	/* defer extent frees until after log rollup */
 	struct stash decycle;	/* defer extent frees until this new cycle */
 	struct stash new_decycle;/* defer extent frees until next new cycle */
+	spinlock_t stash_lock;	/* protects stash_pool */
+	struct link stash_pool;	/* free stash pages */
+	unsigned stash_pool_pages; /* pages in stash_pool */
 
 	struct list_head pinned; /* dirty metadata not flushed per delta */
 	struct list_head commit; /* dirty metadata flushed per delta */
@@ -287,6 +413,26 @@ struct logblock {
 	unsigned char data[];	/* Log data */
 };
 
+/*
+ * A log chain pointer is (count << 48 | block): block and the count - 1
+ * blocks physically below it are consecutive in the chain.  Zero count
+ * is an old single block pointer.
+ */
+static inline u64 logchain_ptr(block_t block, unsigned count)
+{
+	return ((u64)count << 48) | block;
+}
+
+static inline block_t logchain_block(u64 logchain)
+{
+	return logchain & ~(-1ULL << 48);
+}
+
+static inline unsigned logchain_count(u64 logchain)
+{
+	return (logchain >> 48) ? : 1;
+}
+
 enum {
 	LOG_BALLOC = 0x33,	/* Log of block allocation */
 	LOG_BFREE,		/* Log of freeing block */
@@ -297,6 +443,7 @@ enum {
 	LOG_BNODE_SPLIT,	/* Log of spliting bnode to new bnode */
 	LOG_BNODE_ADD,		/* Log of adding bnode entry */
 	LOG_BNODE_UPDATE,	/* Log of bnode entry update */
+	LOG_REDIRECT_PATH,	/* Log of redirecting a leaf and its parents */
 	LOG_TYPES
 };
 
@@ -317,6 +464,7 @@ typedef struct {
 	unsigned present;	/* Attributes decoded from or to be encoded to inode table */
 	struct xcache *xcache;	/* Extended attribute cache */
 	struct list_head alloc_list; /* link for deferred inum allocation */
+	unsigned reserved;	/* Dirty blocks reserved but not yet mapped */
 	struct inode vfs_inode;	/* Generic kernel inode */
 } tuxnode_t;
 
@@ -369,6 +517,7 @@ typedef struct inode {
 	unsigned present;
 	struct xcache *xcache;
 	struct list_head alloc_list; /* link for deferred inum allocation */
+	unsigned reserved;	/* Dirty blocks reserved but not yet mapped */
 	/* generic part of inode */
 	struct sb *i_sb;
 	map_t *map;
@@ -437,8 +586,14 @@ typedef struct {
 	char name[];
 } tux_dirent;
 
-/* version:10, count:6, block:48 */
+/*
+ * unwritten:1, count:15, block:48
+ *
+ * TUX3_MAGIC_DLEAF leaves have version:10, count:6 in place of
+ * unwritten:1, count:15.
+ */
 struct diskextent { be_u64 block_count_version; };
+#define EXTENT_UNWRITTEN (1ULL << 63)	/* Allocated, reads as zero */
 #define MAX_GROUP_ENTRIES 255
 /* count:8, keyhi:24 */
 struct group { be_u32 count_and_keyhi; };
@@ -515,7 +670,7 @@ static inline void inc_entry_limit(struct entry *entry, int n)
 
 static inline struct diskextent make_extent(block_t block, unsigned count)
 {
-	assert(block < (1ULL << 48) && count - 1 < (1 << 6));
+	assert(block < (1ULL << 48) && count - 1 < MAX_EXTENT);
 	return (struct diskextent){ to_be_u64(((u64)(count - 1) << 48) | block) };
 }
 
@@ -526,12 +681,18 @@ static inline block_t extent_block(struct diskextent extent)
 
 static inline unsigned extent_count(struct diskextent extent)
 {
-	return ((from_be_u64(*(be_u64 *)&extent) >> 48) & 0x3f) + 1;
+	return ((from_be_u64(*(be_u64 *)&extent) >> 48) & (MAX_EXTENT - 1)) + 1;
 }
 
-static inline unsigned extent_version(struct diskextent extent)
+static inline int extent_unwritten(struct diskextent extent)
 {
-	return from_be_u64(*(be_u64 *)&extent) >> 54;
+	return !!(from_be_u64(*(be_u64 *)&extent) & EXTENT_UNWRITTEN);
+}
+
+static inline struct diskextent set_extent_unwritten(struct diskextent extent, int unwritten)
+{
+	u64 value = from_be_u64(*(be_u64 *)&extent) & ~EXTENT_UNWRITTEN;
+	return (struct diskextent){ to_be_u64(value | (unwritten ? EXTENT_UNWRITTEN : 0)) };
 }
 
 /* dleaf wrappers */
@@ -678,14 +839,22 @@ static inline int has_root(struct btree *btree)
 }
 
 /* for tree_chop */
+/*
+ * tree_chop() state.  A chop visiting @blocks leaves, or running past its
+ * deadline, suspends and sets @resume to the key to continue from.
+ */
 struct delete_info {
-	tuxkey_t key;
-	block_t blocks, freed;
-	block_t resume;
+	tuxkey_t key;		/* Chop everything from this key on */
+	block_t blocks, freed;	/* Leaf budget, 0 for none, and leaves done */
+	block_t resume;		/* Key to resume from, 0 to start at key */
 	int create;
 };
 
+/* Leaves truncate chops per btree lock hold, all in one delta */
+#define CHOP_SLICE 64
+
 typedef int (*unstash_t)(struct sb *sb, u64 val);
+typedef int (*unstash_vec_t)(struct sb *sb, u64 *vec, unsigned count);
 
 #ifdef __KERNEL__
 static inline struct timespec gettime(void)
@@ -767,9 +936,17 @@ int syncio(int rw, struct block_device *dev, loff_t offset, unsigned vecs,
 int devio(int rw, struct block_device *dev, loff_t offset, void *data,
 	  unsigned len);
 
+static inline int blockdiscard(struct sb *sb, block_t block, block_t count)
+{
+	return sb_issue_discard(sb->vfs_sb, block, count);
+}
+
 /* temporary hack for buffer */
 struct buffer_head *blockread(struct address_space *mapping, block_t iblock);
 struct buffer_head *blockget(struct address_space *mapping, block_t iblock);
+struct buffer_head *blockpeek(struct address_space *mapping, block_t iblock);
+void blockreadahead(struct sb *sb, block_t block);
+int blockcached(struct sb *sb, block_t block);
 
 static inline void blockput(struct buffer_head *buffer)
 {
@@ -798,7 +975,13 @@ block_t bitmap_dump(struct inode *inode, block_t start, block_t count);
 block_t balloc_from_range(struct sb *sb, block_t start, unsigned count, unsigned blocks);
 int balloc(struct sb *sb, unsigned blocks, block_t *block);
 int bfree(struct sb *sb, block_t start, unsigned blocks);
+int bfree_extents(struct sb *sb, u64 *vec, unsigned count);
+void discard_extents(struct sb *sb, u64 *vec, unsigned count);
+block_t trim_free(struct sb *sb, block_t start, block_t count, unsigned minlen);
 int update_bitmap(struct sb *sb, block_t start, unsigned count, int set);
+int balloc_extent(struct sb *sb, unsigned blocks, block_t *block, unsigned *count);
+int reserve_blocks(struct inode *inode, unsigned blocks);
+void release_blocks(struct inode *inode, unsigned blocks);
 
 /* btree.c */
 unsigned calc_entries_per_node(unsigned blocksize);
@@ -814,12 +997,19 @@ int free_empty_btree(struct btree *btree);
 struct buffer_head *new_leaf(struct btree *btree);
 int probe(struct cursor *cursor, tuxkey_t key);
 int advance(struct cursor *cursor);
+int bulk_begin(struct btree *btree, struct bulk_load *bulk, unsigned leaves);
+struct buffer_head *bulk_leaf(struct bulk_load *bulk, tuxkey_t key);
+int bulk_end(struct bulk_load *bulk);
+int scan_begin(struct cursor *cursor, tuxkey_t key, tuxkey_t limit);
+int scan_next(struct cursor *cursor, tuxkey_t limit);
 tuxkey_t next_key(struct cursor *cursor, int depth);
 int tree_chop(struct btree *btree, struct delete_info *info, millisecond_t deadline);
 int btree_insert_leaf(struct cursor *cursor, tuxkey_t key, struct buffer_head *leafbuf);
 void *tree_expand(struct cursor *cursor, tuxkey_t key, unsigned newsize);
 void show_tree_range(struct btree *btree, tuxkey_t start, unsigned count);
 void show_tree(struct btree *btree);
+int btree_stats(struct btree *btree, struct btree_stats *stats);
+int __cursor_redirect(struct cursor *cursor);
 int cursor_redirect(struct cursor *cursor);
 
 /* commit.c */
@@ -827,6 +1017,10 @@ int load_sb(struct sb *sb);
 int save_sb(struct sb *sb);
 int load_itable(struct sb *sb);
 void clean_buffer(struct buffer_head *buffer);
+unsigned replay_cost(struct sb *sb);
+int sync_delta(struct sb *sb, unsigned delta);
+int force_delta(struct sb *sb);
+int format_delta_stats(struct sb *sb, char *buf, size_t size);
 int change_begin(struct sb *sb);
 int change_end(struct sb *sb);
 
@@ -841,6 +1035,7 @@ int tux_dir_is_empty(struct inode *dir);
 
 /* dtree.c */
 int dleaf_init(struct btree *btree, vleaf *leaf);
+int dleaf_convert(struct dleaf *leaf, int write);
 unsigned dleaf_free(struct btree *btree, vleaf *leaf);
 void dleaf_dump(struct btree *btree, vleaf *vleaf);
 int dleaf_split_at(vleaf *from, vleaf *into, struct entry *entry,
@@ -852,6 +1047,7 @@ extern struct btree_ops dtree_ops;
 int dwalk_end(struct dwalk *walk);
 block_t dwalk_block(struct dwalk *walk);
 unsigned dwalk_count(struct dwalk *walk);
+int dwalk_unwritten(struct dwalk *walk);
 tuxkey_t dwalk_index(struct dwalk *walk);
 int dwalk_next(struct dwalk *walk);
 int dwalk_back(struct dwalk *walk);
@@ -861,6 +1057,9 @@ void dwalk_copy(struct dwalk *walk, struct dleaf *dest);
 void dwalk_chop(struct dwalk *walk);
 int dwalk_add(struct dwalk *walk, tuxkey_t index, struct diskextent extent);
 
+/* filemap.c */
+int map_prealloc(struct inode *inode, block_t start, block_t count);
+
 /* iattr.c */
 unsigned encode_asize(unsigned bits);
 void dump_attrs(struct inode *inode);
@@ -871,6 +1070,8 @@ void *decode_attrs(struct inode *inode, void *attrs, unsigned size);
 void *ileaf_lookup(struct btree *btree, inum_t inum, struct ileaf *leaf, unsigned *result);
 inum_t find_empty_inode(struct btree *btree, struct ileaf *leaf, inum_t goal);
 void ileaf_purge(struct btree *btree, inum_t inum, struct ileaf *leaf);
+int ileaf_enumerate(struct btree *btree, struct ileaf *leaf,
+		    int (*actor)(void *data, inum_t inum), void *data);
 extern struct btree_ops itable_ops;
 
 /* inode.c */
@@ -878,6 +1079,9 @@ struct inode *tux_new_volmap(struct sb *sb);
 struct inode *tux_new_logmap(struct sb *sb);
 
 /* log.c */
+extern const unsigned logsize[LOG_TYPES];
+unsigned log_recsize(const unsigned char *rec);
+unsigned log_compact(struct sb *sb, unsigned start, unsigned end);
 void log_next(struct sb *sb);
 void log_drop(struct sb *sb);
 void log_finish(struct sb *sb);
@@ -886,6 +1090,7 @@ void log_bfree(struct sb *sb, block_t block, unsigned count);
 void log_bfree_on_rollup(struct sb *sb, block_t block, unsigned count);
 void log_leaf_redirect(struct sb *sb, block_t oldblock, block_t newblock);
 void log_bnode_redirect(struct sb *sb, block_t oldblock, block_t newblock);
+void log_redirect_path(struct sb *sb, block_t newbase, block_t *oldblocks, unsigned levels);
 void log_bnode_root(struct sb *sb, block_t root, unsigned count,
 		    block_t left, block_t right, tuxkey_t rkey);
 void log_bnode_split(struct sb *sb, block_t src, unsigned pos, block_t dest);
@@ -895,10 +1100,12 @@ void log_bnode_update(struct sb *sb, block_t parent, block_t child,
 void log_droot(struct sb *sb, block_t newroot, block_t oldroot, tuxkey_t key);
 void log_iroot(struct sb *sb, block_t newroot, block_t oldroot);
 
-int stash_value(struct stash *stash, u64 value);
+int stash_value(struct sb *sb, struct stash *stash, u64 value);
 int unstash(struct sb *sb, struct stash *defree, unstash_t actor);
-int defer_bfree(struct stash *defree, block_t block, unsigned count);
-void destroy_defer_bfree(struct stash *defree);
+int unstash_vec(struct sb *sb, struct stash *stash, unstash_vec_t actor);
+int defer_bfree(struct sb *sb, struct stash *defree, block_t block, unsigned count);
+void destroy_defer_bfree(struct sb *sb, struct stash *defree);
+void destroy_stash_pool(struct sb *sb);
 
 /* replay.c */
 int replay(struct sb *sb);
@@ -942,4 +1149,9 @@ static inline struct buffer_head *vol_bread(struct sb *sb, block_t block)
 {
 	return blockread(mapping(sb->volmap), block);
 }
+
+static inline struct buffer_head *vol_peek(struct sb *sb, block_t block)
+{
+	return blockpeek(mapping(sb->volmap), block);
+}
 #endif
@@ -62,6 +62,14 @@ typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
 
+/* lib/sort.c emulation, swap_func is ignored */
+static inline void sort(void *base, size_t num, size_t size,
+			int (*cmp_func)(const void *, const void *),
+			void (*swap_func)(void *, void *, int size))
+{
+	qsort(base, num, size, cmp_func);
+}
+
 /* Kernel page emulation for deferred free support */
 
 typedef unsigned __bitwise__ gfp_t;
@@ -19,7 +19,7 @@ typedef struct {
 	(spinlock_t){ }
 #endif
 #define DEFINE_SPINLOCK(x) spinlock_t x = __SPIN_LOCK_UNLOCKED
-#define spin_lock_init(lock) do { *(lock) = SPIN_LOCK_UNLOCKED; } while (0)
+#define spin_lock_init(lock) do { *(lock) = __SPIN_LOCK_UNLOCKED; } while (0)
 
 static inline void spin_lock(spinlock_t *lock)
 {
@@ -44,6 +44,7 @@ typedef struct {
 
 #define ATOMIC_INIT(i)	{ (i) }
 #define atomic_read(v)	((v)->counter)
+#define atomic_set(v, i)	(((v)->counter) = (i))
 
 static inline void atomic_inc(atomic_t *v)
 {
@@ -60,6 +61,25 @@ static inline int atomic_dec_and_test(atomic_t *v)
 	return !--v->counter;
 }
 
+/* Userspace is single threaded, so these only have to be serially correct */
+#define smp_rmb()	do { } while (0)
+#define smp_wmb()	do { } while (0)
+#define smp_mb__after_atomic_inc()	do { } while (0)
+#define smp_mb__before_atomic_dec()	do { } while (0)
+
+#define xchg(ptr, new) ({					\
+	typeof(*(ptr)) __old = *(ptr);				\
+	*(ptr) = (new);						\
+	__old;							\
+})
+
+#define cmpxchg(ptr, old, new) ({				\
+	typeof(*(ptr)) __cur = *(ptr);				\
+	if (__cur == (old))					\
+		*(ptr) = (new);					\
+	__cur;							\
+})
+
 static inline int atomic_dec_and_lock(atomic_t *v, spinlock_t *lock)
 {
 	spin_lock(lock);
@@ -55,6 +55,7 @@ int make_tux3(struct sb *sb)
 	}
 	assert(sb->bitmap->inum == TUX_BITMAP_INO);
 	sb->bitmap->i_size = (sb->volblocks + 7) >> 3;
+	sb->freeblocks = sb->volblocks;
 	/* should this?, tuxtruncate(sb->bitmap, (sb->volblocks + 7) >> 3); */
 
 	trace("reserve superblock");
@@ -11,3 +11,28 @@ int bfree(struct sb *sb, block_t block, unsigned blocks)
 	trace("<- %Lx/%x", (L)block, blocks);
 	return 0;
 }
+
+int bfree_extents(struct sb *sb, u64 *vec, unsigned count)
+{
+	trace("<- %u extents", count);
+	return 0;
+}
+
+void discard_extents(struct sb *sb, u64 *vec, unsigned count)
+{
+}
+
+int balloc_extent(struct sb *sb, unsigned blocks, block_t *block, unsigned *count)
+{
+	*count = blocks;
+	return balloc(sb, blocks, block);
+}
+
+int reserve_blocks(struct inode *inode, unsigned blocks)
+{
+	return 0;
+}
+
+void release_blocks(struct inode *inode, unsigned blocks)
+{
+}
@@ -87,5 +87,36 @@ int main(int argc, char *argv[])
 	bfree(sb, 0x7e, 1);
 	bfree(sb, 0x80, 1);
 	bitmap_dump(bitmap, 0, sb->volblocks);
+
+	/* batched free: unsorted, adjacent, and crossing a bitmap block */
+	block_t free = sb->freeblocks;
+	assert(!update_bitmap(sb, 0x80, 1, 1));
+	assert(sb->freeblocks == --free);
+	u64 vec[] = {
+		((u64)2 << 48) | 0x7b, ((u64)2 << 48) | 0x79,
+		((u64)2 << 48) | 0x7f, ((u64)1 << 48) | 0x7d,
+	};
+	assert(!bfree_extents(sb, vec, ARRAY_SIZE(vec)));
+	assert(sb->freeblocks == free + 7);
+	assert(!count_range(bitmap, 0x78, 8));
+	assert(count_range(bitmap, 0x80, 8) == 5);
+	bitmap_dump(bitmap, 0, sb->volblocks);
+
+	/* fragmented volume: the longest free runs are found, not halved */
+	for (int i = 0; i < 3; i++) {
+		struct buffer_head *buffer = blockread(bitmap->map, i);
+		memset(bufdata(buffer), 0xff, blocksize);
+		blockput_dirty(buffer);
+	}
+	sb->freeblocks = 0;
+	assert(!update_bitmap(sb, 0x10, 2, 0));
+	assert(!update_bitmap(sb, 0x45, 5, 0));
+	assert(!update_bitmap(sb, 0x70, 3, 0));
+	assert(sb->freeblocks == 10);
+	unsigned got;
+	assert(!balloc_extent(sb, 8, &block, &got) && block == 0x45 && got == 5);
+	assert(!balloc_extent(sb, 8, &block, &got) && block == 0x70 && got == 3);
+	assert(!balloc_extent(sb, 2, &block, &got) && block == 0x10 && got == 2);
+	assert(balloc_extent(sb, 1, &block, &got) == -ENOSPC);
 	exit(0);
 }
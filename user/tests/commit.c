@@ -15,7 +15,15 @@
 
 int bitmap_io(struct buffer_head *buffer, int write)
 {
-	return (write) ? write_bitmap(buffer) : filemap_extent_io(buffer, 0);
+	return (write) ? write_bitmap(buffer, bufdata(buffer)) : filemap_extent_io(buffer, 0);
+}
+
+static unsigned entries;
+
+static int count_entries(struct sb *sb, u64 val)
+{
+	entries++;
+	return 0;
 }
 
 int main(int argc, char *argv[])
@@ -41,6 +49,51 @@ int main(int argc, char *argv[])
 	assert(!make_tux3(sb));
 
 	sb->bitmap->map->io = bitmap_io;
+	if (1) { /* log compaction merges adjacent extent records */
+		unsigned start = sb->lognext;
+		for (int i = 0; i < 60; i++) {
+			if (i == 30)
+				log_bnode_add(sb, 1, 2, 3);
+			log_balloc(sb, 0x100 + i, 1);
+		}
+		log_finish(sb);
+		assert(sb->lognext - start > 2);
+		assert(log_compact(sb, start, sb->lognext) == start + 1);
+		struct buffer_head *buffer = blockget(mapping(sb->logmap), start);
+		struct logblock *log = bufdata(buffer);
+		unsigned count;
+		u64 block;
+		assert(from_be_u16(log->bytes) == 9 + 19 + 9);
+		assert(log->data[0] == LOG_BALLOC && log->data[9] == LOG_BNODE_ADD);
+		decode48(decode16(log->data + 1, &count), &block);
+		assert(block == 0x100 && count == 30);
+		decode48(decode16(log->data + 29, &count), &block);
+		assert(block == 0x11e && count == 30);
+		blockput(buffer);
+		sb->lognext = start;
+	}
+	if (1) { /* a redirect path record survives compaction whole */
+		unsigned start = sb->lognext;
+		block_t oldblocks[] = { 0x10, 0x20, 0x30 };
+		log_balloc(sb, 0x100, 1);
+		log_redirect_path(sb, 0x200, oldblocks, 3);
+		log_balloc(sb, 0x101, 1);
+		log_finish(sb);
+		assert(log_compact(sb, start, sb->lognext) == start + 1);
+		struct buffer_head *buffer = blockget(mapping(sb->logmap), start);
+		struct logblock *log = bufdata(buffer);
+		u64 block;
+		assert(from_be_u16(log->bytes) == 9 + 8 + 3 * 6 + 9);
+		assert(log->data[9] == LOG_REDIRECT_PATH && log->data[10] == 3);
+		assert(log_recsize(log->data + 9) == 8 + 3 * 6);
+		decode48(log->data + 11, &block);
+		assert(block == 0x200);
+		decode48(log->data + 9 + 8 + 2 * 6, &block);
+		assert(block == 0x30);
+		assert(log->data[9 + 8 + 3 * 6] == LOG_BALLOC);
+		blockput(buffer);
+		sb->lognext = start;
+	}
 	if (1) {
 		sb->super = (struct disksuper){ .magic = TUX3_MAGIC, .volblocks = to_be_u64(sb->volblocks) };
 		for (int i = 0; i < 29; i++) {
@@ -51,6 +104,22 @@ int main(int argc, char *argv[])
 			iput(tuxcreate(sb->rootdir, name, strlen(name), &iattr));
 			change_end(sb);
 		}
+		/* default policy commits every ten changes */
+		assert(sb->commits[COMMIT_CHANGES] == 2 && sb->delta == 2);
+		assert(sb->last_delta.delta == 1 && sb->last_delta.changes == 10);
+		assert(atomic_read(&sb->delta_changes) == 9);
+		/* group commit: a delta already on disk costs nothing */
+		assert(sb->committed == 2);
+		assert(!sync_delta(sb, 1));
+		assert(!sync_delta(sb, sb->delta));
+		assert(sb->committed == 3 && sb->commits[COMMIT_FORCE] == 1);
+		assert(!sync_delta(sb, 2) && !force_delta(sb));
+		assert(sb->commits[COMMIT_FORCE] == 1);
+		char text[256];
+		assert(format_delta_stats(sb, text, sizeof(text)) < sizeof(text));
+		assert(strstr(text, "deltas committed 3: force 1 changes 2"));
+		assert(strstr(text, "last delta 2: force, 9 changes"));
+		assert(format_delta_stats(sb, text, 20) >= 20 && strlen(text) == 19);
 		assert(!save_sb(sb));
 		//assert(!flush_buffers(sb->volmap->map));
 		invalidate_buffers(sb->volmap->map);
@@ -58,11 +127,121 @@ int main(int argc, char *argv[])
 		invalidate_buffers(mapping(sb->logmap));
 		replay(sb);
 
+		/*
+		 * log blocks are written and read back as one contiguous run,
+		 * records that do not fit the bitmap would fail the replay
+		 */
+		for (int i = 0; i < 50; i++) {
+			log_balloc(sb, 0x1000 + 2 * i, 1);
+			log_bfree(sb, 0x1000 + 2 * i, 1);
+		}
+		assert(!force_delta(sb));
+		unsigned logcount = from_be_u32(sb->super.logcount);
+		assert(sb->last_delta.log_blocks > 1);
+		assert(logchain_count(sb->logchain) == logcount);
+		invalidate_buffers(mapping(sb->logmap));
+		assert(!replay(sb));
+		assert(sb->lognext == logcount);
+
+		/* rollup is triggered by replay cost, not by commit count */
+		unsigned rollup = sb->rollup;
+		for (int i = 0; i < 3 * sb->policy.changes; i++) {
+			change_begin(sb);
+			change_end(sb);
+		}
+		assert(sb->rollup == rollup && !sb->last_delta.rollup);
+		sb->policy.replay_budget = replay_cost(sb);
+		assert(!list_empty(&mapping(sb->bitmap)->dirty));
+		for (int i = 0; i < sb->policy.changes; i++) {
+			change_begin(sb);
+			change_end(sb);
+		}
+		assert(sb->rollup == rollup + 1 && sb->last_delta.rollup);
+		sb->policy.replay_budget = 0;
+		/* the rollup wrote the pinned bnodes in the transition */
+		assert(list_empty(&sb->pinned));
+
+		/* consecutive frees take one stash entry, pages are pooled */
+		if (1) {
+			struct stash stash = {};
+			entries = 0;
+			for (int i = 0; i < 100; i++)
+				assert(!defer_bfree(sb, &stash, 0x2000 + i, 1));
+			for (int i = 0; i < 40; i++)
+				assert(!defer_bfree(sb, &stash, 0x3000 + 2 * i, 1));
+			unsigned pool = sb->stash_pool_pages;
+			assert(!unstash(sb, &stash, count_entries));
+			assert(entries == 41);
+			assert(sb->stash_pool_pages > pool);
+			pool = sb->stash_pool_pages;
+			for (int i = 0; i < 40; i++)
+				assert(!defer_bfree(sb, &stash, 0x3000 + 2 * i, 1));
+			assert(sb->stash_pool_pages < pool);
+			destroy_defer_bfree(sb, &stash);
+		}
+
+		/* deferred frees go back to the pool, deltas allocate no pages */
+		if (1) {
+			unsigned pool = 0;
+			for (int i = 0; i < 5; i++) {
+				block_t block;
+				change_begin(sb);
+				assert(!balloc(sb, 1, &block));
+				assert(!defer_bfree(sb, &sb->defree, block, 1));
+				change_end(sb);
+				assert(!force_delta(sb));
+				assert(!i || sb->stash_pool_pages == pool);
+				pool = sb->stash_pool_pages;
+			}
+			assert(pool);
+		}
+
+		/* replay sets logged bits, the super counts them already */
+		if (1) {
+			block_t block;
+			change_begin(sb);
+			assert(!balloc(sb, 3, &block));
+			log_balloc(sb, block, 3);
+			change_end(sb);
+			assert(!force_delta(sb));
+			block_t free = sb->freeblocks;
+			/* the bitmap on disk is from before the allocation */
+			invalidate_buffers(mapping(sb->bitmap));
+			invalidate_buffers(mapping(sb->logmap));
+			assert(!replay(sb));
+			assert(sb->freeblocks == free);
+			unsigned mapshift = sb->blockbits + 3;
+			struct buffer_head *buffer = blockread(mapping(sb->bitmap), block >> mapshift);
+			assert(all_set(bufdata(buffer), block & ((1 << mapshift) - 1), 3));
+			blockput(buffer);
+		}
+
+		/* a delta that fails to write stays uncommitted */
+		if (1) {
+			int fd = sb->dev->fd;
+			unsigned committed = sb->committed;
+			struct tux_iattr iattr = { .mode = S_IFREG | S_IRWXU };
+			change_begin(sb);
+			iput(tuxcreate(sb->rootdir, "doomed", 6, &iattr));
+			change_end(sb);
+			sb->dev->fd = -1;
+			unsigned delta = sb->delta;
+			int err = force_delta(sb);
+			assert(err < 0 && sb->commit_err == err);
+			assert(sb->committed == committed);
+			/* waiting for a flush that failed reports its error */
+			assert(sync_delta(sb, delta) == err);
+			sb->dev->fd = fd;
+			/* later deltas can not commit over the lost one */
+			assert(force_delta(sb) == err && sb->committed == committed);
+		}
+
 		/* free stash for valgrind */
-		destroy_defer_bfree(&sb->new_decycle);
-		destroy_defer_bfree(&sb->decycle);
-		destroy_defer_bfree(&sb->derollup);
-		destroy_defer_bfree(&sb->defree);
+		destroy_defer_bfree(sb, &sb->new_decycle);
+		destroy_defer_bfree(sb, &sb->decycle);
+		destroy_defer_bfree(sb, &sb->derollup);
+		destroy_defer_bfree(sb, &sb->defree);
+		destroy_stash_pool(sb);
 	}
 	exit(0);
 }
@@ -120,6 +120,30 @@ int main(int argc, char *argv[])
 	dleaf_destroy(btree, leaf);
 	dleaf_destroy(btree, dest);
 
+	if (1) {
+		/* appending past the last entry moves only that entry out */
+		struct dleaf *leaf1 = dleaf_create(btree);
+		struct dwalk *walk1 = &(struct dwalk){ };
+		dwalk_probe(leaf1, blocksize, walk1, 0);
+		for (int i = 0; i < 2 * MAX_GROUP_ENTRIES; i++)
+			dwalk_add(walk1, i, make_extent(10 + i, 1));
+		struct dleaf *leaf2 = dleaf_create(btree);
+		tuxkey_t key = dleaf_split(btree, 100, leaf1, leaf2);
+		assert(key == 2 * MAX_GROUP_ENTRIES - 1);
+		dwalk_probe(leaf1, blocksize, walk1, 0);
+		for (int i = 0; i < 2 * MAX_GROUP_ENTRIES - 1; i++) {
+			assert(dwalk_index(walk1) == i);
+			dwalk_next(walk1);
+		}
+		assert(dwalk_end(walk1));
+		dwalk_probe(leaf2, blocksize, walk1, 0);
+		assert(dwalk_index(walk1) == key);
+		assert(dwalk_block(walk1) == 10 + key);
+		dwalk_next(walk1);
+		assert(dwalk_end(walk1));
+		dleaf_destroy(btree, leaf1);
+		dleaf_destroy(btree, leaf2);
+	}
 	if (1) {
 		for (int chop = 1; chop < MAX_GROUP_ENTRIES + 1; chop++) {
 			/* dleaf_merge() test */
@@ -323,5 +347,45 @@ int main(int argc, char *argv[])
 		assert(nr == 5);
 		dleaf_destroy(btree, leaf1);
 	}
+	if (1) {
+		/* dleaf2 extents beyond the old 64 block limit, old leaf conversion */
+		struct dleaf *leaf1 = dleaf_create(btree);
+		struct dwalk *walk1 = &(struct dwalk){ };
+		dwalk_probe(leaf1, blocksize, walk1, 0);
+		dwalk_add(walk1, 0x10, make_extent(0x100, 0x40));
+		dwalk_add(walk1, 0x50, make_extent(0x9000, 3));
+		leaf1->magic = to_be_u16(TUX3_MAGIC_DLEAF);
+		/* readers walk the old leaf unchanged, writers convert it */
+		assert(!dleaf_convert(leaf1, 0));
+		assert(leaf1->magic == to_be_u16(TUX3_MAGIC_DLEAF));
+		assert(!dleaf_convert(leaf1, 1));
+		assert(leaf1->magic == to_be_u16(TUX3_MAGIC_DLEAF2));
+		dwalk_probe(leaf1, blocksize, walk1, 0);
+		assert(dwalk_block(walk1) == 0x100 && dwalk_count(walk1) == 0x40);
+		dwalk_next(walk1);
+		assert(dwalk_count(walk1) == 3 && !dwalk_unwritten(walk1));
+		dwalk_next(walk1);
+		dwalk_add(walk1, 0x100, make_extent(0x10000, MAX_EXTENT));
+		dwalk_probe(leaf1, blocksize, walk1, 0x100);
+		assert(dwalk_block(walk1) == 0x10000 && dwalk_count(walk1) == MAX_EXTENT);
+		assert(!dwalk_unwritten(walk1));
+		/* an old leaf with versions set is refused, not converted */
+		leaf1->magic = to_be_u16(TUX3_MAGIC_DLEAF);
+		assert(dleaf_convert(leaf1, 1) == -EINVAL);
+		assert(leaf1->magic == to_be_u16(TUX3_MAGIC_DLEAF));
+		/* the lowest and the highest version bit alike */
+		struct dleaf *leaf2 = dleaf_create(btree);
+		dwalk_probe(leaf2, blocksize, walk1, 0);
+		dwalk_add(walk1, 0x10, make_extent(0x100, 1));
+		leaf2->magic = to_be_u16(TUX3_MAGIC_DLEAF);
+		leaf2->table[0].block_count_version |= to_be_u64(1ULL << 54);
+		assert(dleaf_convert(leaf2, 0) == -EINVAL);
+		leaf2->table[0] = set_extent_unwritten(make_extent(0x100, 1), 1);
+		assert(dleaf_convert(leaf2, 0) == -EINVAL);
+		leaf2->table[0] = make_extent(0x100, 1);
+		assert(!dleaf_convert(leaf2, 0));
+		dleaf_destroy(btree, leaf2);
+		dleaf_destroy(btree, leaf1);
+	}
 	return 0;
 }
@@ -101,8 +101,8 @@ int main(int argc, char *argv[])
 		/* free leaked blocks by redirect */
 		assert(!bfree(sb, redirect_block, 20));
 		/* free stash for valgrind */
-		destroy_defer_bfree(&sb->defree);
-		destroy_defer_bfree(&sb->derollup);
+		destroy_defer_bfree(sb, &sb->defree);
+		destroy_defer_bfree(sb, &sb->derollup);
 		sb->nextalloc = nextalloc;
 	}
 
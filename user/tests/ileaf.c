@@ -46,6 +46,13 @@ static void test_remove(struct btree *btree, struct ileaf *leaf, inum_t inum, in
 	attrs = ileaf_resize(btree, inum, leaf, size - less);
 }
 
+static int test_enumerate(void *data, inum_t inum)
+{
+	inum_t **seen = data;
+	*(*seen)++ = inum;
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	printf("--- test inode table leaf methods ---\n");
@@ -79,6 +86,11 @@ int main(int argc, char *argv[])
 	hexdump(inode, size);
 	for (int i = 0x11; i <= 0x20; i++)
 		printf("goal 0x%x => 0x%Lx\n", i, (L)find_empty_inode(btree, leaf, i));
+	inum_t inums[8], *seen = inums;
+	ileaf_enumerate(btree, leaf, test_enumerate, &seen);
+	assert(seen - inums == 4);
+	assert(inums[0] == 0x13 && inums[1] == 0x14);
+	assert(inums[2] == 0x16 && inums[3] == 0x18);
 	ileaf_purge(btree, 0x14, leaf);
 	ileaf_purge(btree, 0x18, leaf);
 	ileaf_check(btree, leaf);
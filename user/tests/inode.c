@@ -42,6 +42,8 @@ int main(int argc, char *argv[])
 	tuxseek(file, 4092);
 	err = tuxwrite(file, "hello ", 6);
 	err = tuxwrite(file, "world!", 6);
+	/* delayed allocation reserved the two dirty blocks */
+	assert(inode->reserved == 2 && sb->reserved == 2);
 #if 0
 	flush_buffers(mapping(sb->bitmap));
 	flush_buffers(sb->volmap->map);
@@ -50,6 +52,7 @@ int main(int argc, char *argv[])
 	trace(">>> close file <<<");
 	set_xattr(inode, "foo", 5, "hello world!", 12, 0);
 	sync_inode(inode);
+	assert(!inode->reserved && !sb->reserved);
 	iput(inode);
 	trace(">>> open file");
 	file = &(struct file){ .f_inode = tuxopen(sb->rootdir, "foo", 3) };
@@ -65,6 +68,41 @@ int main(int argc, char *argv[])
 	if (got < 0)
 		exit(1);
 	hexdump(buf, got);
+	if (1) { /* only blocks nothing maps yet reserve, truncate releases them */
+		tuxseek(file, 4092);
+		assert(tuxwrite(file, "HELLO ", 6) == 6);
+		assert(!inode->reserved && !sb->reserved);
+		tuxseek(file, 3 << sb->blockbits);
+		assert(tuxwrite(file, "again", 5) == 5);
+		assert(inode->reserved == 1 && sb->reserved == 1);
+		assert(!tuxtruncate(inode, 2 << sb->blockbits));
+		assert(!inode->reserved && !sb->reserved);
+		assert(!sync_inode(inode));
+		assert(!inode->reserved && !sb->reserved);
+	}
+	trace(">>> preallocate file");
+	if (1) {
+		struct inode *inode = tuxcreate(sb->rootdir, "bar", 3, &(struct tux_iattr){ .mode = S_IFREG | S_IRWXU });
+		assert(inode);
+		struct file *file = &(struct file){ .f_inode = inode };
+		char data[6] = { };
+		err = tuxfallocate(inode, 0, 5 << sb->blockbits, 0);
+		assert(!err && inode->i_size == 5 << sb->blockbits);
+		block_t free = sb->freeblocks;
+		/* writes into the preallocated range allocate nothing */
+		tuxseek(file, 2 << sb->blockbits);
+		assert(tuxwrite(file, "hello", 5) == 5);
+		sync_inode(inode);
+		assert(sb->freeblocks == free);
+		invalidate_buffers(mapping(inode));
+		/* unwritten blocks read as zero, written one reads back */
+		tuxseek(file, (1 << sb->blockbits) + 2);
+		assert(tuxread(file, data, 5) == 5 && !memcmp(data, "\0\0\0\0\0", 5));
+		tuxseek(file, 2 << sb->blockbits);
+		assert(tuxread(file, data, 5) == 5 && !memcmp(data, "hello", 5));
+		iput(inode);
+	}
+
 	trace(">>> show state");
 	show_buffers(mapping(file->f_inode));
 	show_buffers(mapping(sb->rootdir));
@@ -109,6 +147,238 @@ int main(int argc, char *argv[])
 		tux_delete_inode(inode4);
 	}
 
+	if (1) { /* bulk load packs index nodes bottom up */
+		struct inode *inode = tuxcreate(sb->rootdir, "bulk", 4, &(struct tux_iattr){ .mode = S_IFREG | S_IRWXU });
+		assert(inode);
+		struct btree *btree = &tux_inode(inode)->btree;
+		struct bulk_load bulk;
+		block_t leaves[50], before = sb->freeblocks;
+		assert(!bulk_begin(btree, &bulk, 50));
+		for (int i = 0; i < 50; i++) {
+			struct buffer_head *buffer = bulk_leaf(&bulk, i * 0x100);
+			assert(!IS_ERR(buffer));
+			leaves[i] = bufindex(buffer);
+			blockput(buffer);
+		}
+		assert(!bulk_end(&bulk));
+		assert(btree->root.depth == 2);
+		/* one extent: the leaves in order, then the four index nodes */
+		assert(before - sb->freeblocks == 50 + 4);
+		for (int i = 0; i < 50; i++)
+			assert(leaves[i] == leaves[0] + i);
+		struct cursor *cursor = alloc_cursor(btree, 0);
+		for (int i = 0; i < 50; i++) {
+			assert(!probe(cursor, i * 0x100 + 0x80));
+			assert(bufindex(cursor_leafbuf(cursor)) == leaves[i]);
+			release_cursor(cursor);
+		}
+		/* the finger holds no buffers, a hit finds the same ones cached */
+		struct buffer_head *leafbuf = peekblk(mapping(sb->volmap), leaves[10]);
+		int count = bufcount(leafbuf);
+		assert(!probe(cursor, 10 * 0x100 + 0x10));
+		assert(cursor_leafbuf(cursor) == leafbuf);
+		release_cursor(cursor);
+		assert(btree->finger.depth && bufcount(leafbuf) == count);
+		assert(!probe(cursor, 10 * 0x100 + 0x20));
+		assert(cursor_leafbuf(cursor) == leafbuf);
+		release_cursor(cursor);
+		assert(bufcount(leafbuf) == count);
+		blockput(leafbuf);
+		free_cursor(cursor);
+
+		/* stats: every block still cached, empty leaves */
+		struct btree_stats stats = { };
+		assert(!btree_stats(btree, &stats));
+		assert(stats.depth == 2 && stats.nodes == 4 && stats.leaves == 50);
+		assert(stats.entries == 3 + 50 && stats.cached == 4 + 50);
+		assert(stats.fill[0] == 50 && stats.jumps < 50);
+		/* counts add up across trees, itable leaves report fill too */
+		assert(!btree_stats(itable_btree(sb), &stats));
+		block_t filled = 0;
+		for (int i = 0; i < STATS_FILL_BUCKETS; i++)
+			filled += stats.fill[i];
+		assert(stats.leaves > 50 && filled == stats.leaves);
+
+		/* chop in slices of ten leaves, resuming each time */
+		struct delete_info info = { .key = 0 };
+		int slices = 0, ret;
+		do {
+			info.blocks = info.freed + 10;
+			ret = tree_chop(btree, &info, 0);
+			assert(ret >= 0);
+			slices++;
+		} while (ret);
+		assert(slices == 5 && info.freed == 50);
+		assert(!btree->finger.depth);
+		iput(inode);
+	}
+
+	if (1) { /* more leaves than announced: the whole extent goes back */
+		struct inode *inode = tuxcreate(sb->rootdir, "abort", 5, &(struct tux_iattr){ .mode = S_IFREG | S_IRWXU });
+		assert(inode);
+		struct btree *btree = &tux_inode(inode)->btree;
+		struct bulk_load bulk;
+		block_t before = sb->freeblocks;
+		assert(!bulk_begin(btree, &bulk, 10));
+		for (int i = 0; i < 10; i++) {
+			struct buffer_head *buffer = bulk_leaf(&bulk, i * 0x100);
+			assert(!IS_ERR(buffer));
+			blockput(buffer);
+		}
+		assert(PTR_ERR(bulk_leaf(&bulk, 10 * 0x100)) == -E2BIG);
+		assert(bulk_end(&bulk) == -E2BIG);
+		assert(!has_root(btree) && sb->freeblocks == before);
+		iput(inode);
+	}
+
+	if (1) { /* appending leaves keeps index nodes full */
+		struct inode *inode = tuxcreate(sb->rootdir, "append", 6, &(struct tux_iattr){ .mode = S_IFREG | S_IRWXU });
+		assert(inode);
+		struct btree *btree = &tux_inode(inode)->btree;
+		assert(!alloc_empty_btree(btree));
+		block_t free = sb->freeblocks;
+		struct cursor *cursor = alloc_cursor(btree, 1);
+		assert(!probe(cursor, 0));
+		for (int i = 1; i < 50; i++) {
+			struct buffer_head *buffer = new_leaf(btree);
+			assert(!IS_ERR(buffer));
+			assert(!btree_insert_leaf(cursor, i * 0x100, buffer));
+		}
+		release_cursor(cursor);
+		free_cursor(cursor);
+		/* 49 leaves, nodes of 19 + 19 + 12 entries, one new root */
+		assert(btree->root.depth == 2);
+		assert(free - sb->freeblocks == 49 + 2 + 1);
+		tree_chop(btree, &(struct delete_info){ .key = 0 }, 0);
+		iput(inode);
+	}
+
+	if (1) { /* redirect a clean path as one extent, then a lone leaf */
+		struct inode *inode = tuxcreate(sb->rootdir, "redirect", 8, &(struct tux_iattr){ .mode = S_IFREG | S_IRWXU });
+		assert(inode);
+		struct btree *btree = &tux_inode(inode)->btree;
+		struct bulk_load bulk;
+		assert(!bulk_begin(btree, &bulk, 50));
+		for (int i = 0; i < 50; i++) {
+			struct buffer_head *buffer = bulk_leaf(&bulk, i * 0x100);
+			assert(!IS_ERR(buffer));
+			blockput(buffer);
+		}
+		assert(!bulk_end(&bulk));
+		assert(btree->root.depth == 2);
+		struct cursor *cursor = alloc_cursor(btree, 0);
+		assert(!probe(cursor, 25 * 0x100 + 0x80));
+		/* as if the whole path had been committed */
+		static block_t old[3];
+		for (int level = 0; level <= 2; level++) {
+			set_buffer_clean(cursor->path[level].buffer);
+			old[level] = bufindex(cursor->path[level].buffer);
+		}
+		block_t free = sb->freeblocks;
+		log_finish(sb);
+		unsigned start = sb->lognext;
+		assert(!__cursor_redirect(cursor));
+		log_finish(sb);
+		/* leaf first, each parent in the block after its child */
+		block_t base = bufindex(cursor->path[2].buffer);
+		assert(bufindex(cursor->path[1].buffer) == base + 1);
+		assert(bufindex(cursor->path[0].buffer) == base + 2);
+		assert(btree->root.block == base + 2);
+		assert(free - sb->freeblocks == 3);
+		/* the clones are only cache, keep them; a new probe finds them */
+		mark_buffer_rollup_non(cursor->path[0].buffer);
+		mark_buffer_rollup_non(cursor->path[1].buffer);
+		mark_buffer_dirty_non(cursor->path[2].buffer);
+		release_cursor(cursor);
+		assert(!probe(cursor, 25 * 0x100 + 0x80));
+		for (int level = 0; level <= 2; level++)
+			assert(bufindex(cursor->path[level].buffer) == base + 2 - level);
+		/* one record for the whole path */
+		struct buffer_head *logbuf = blockget(mapping(sb->logmap), start);
+		struct logblock *log = bufdata(logbuf);
+		u64 block;
+		assert(from_be_u16(log->bytes) == 8 + 3 * 6);
+		assert(log->data[0] == LOG_REDIRECT_PATH && log->data[1] == 3);
+		unsigned char *data = decode48(log->data + 2, &block);
+		assert(block == base);
+		for (int level = 2; level >= 0; level--) {
+			data = decode48(data, &block);
+			assert(block == old[level]);
+		}
+		blockput(logbuf);
+
+		/* only the leaf is clean: its dirty parent gets the new leaf */
+		set_buffer_clean(cursor->path[2].buffer);
+		start = sb->lognext;
+		assert(!__cursor_redirect(cursor));
+		log_finish(sb);
+		block_t leaf = bufindex(cursor->path[2].buffer);
+		assert(leaf != base);
+		mark_buffer_dirty_non(cursor->path[2].buffer);
+		release_cursor(cursor);
+		assert(!probe(cursor, 25 * 0x100 + 0x80));
+		assert(bufindex(cursor->path[1].buffer) == base + 1);
+		assert(bufindex(cursor->path[2].buffer) == leaf);
+		logbuf = blockget(mapping(sb->logmap), start);
+		log = bufdata(logbuf);
+		assert(from_be_u16(log->bytes) == logsize[LOG_LEAF_REDIRECT] + logsize[LOG_BNODE_UPDATE]);
+		assert(log->data[0] == LOG_LEAF_REDIRECT);
+		data = log->data + logsize[LOG_LEAF_REDIRECT];
+		assert(*data++ == LOG_BNODE_UPDATE);
+		data = decode48(data, &block);
+		assert(block == base + 1);
+		decode48(data, &block);
+		assert(block == leaf);
+		blockput(logbuf);
+
+		release_cursor(cursor);
+		free_cursor(cursor);
+		tree_chop(btree, &(struct delete_info){ .key = 0 }, 0);
+		iput(inode);
+	}
+
+	if (1) { /* batch trim punches free blocks out of the image */
+		block_t last = sb->volblocks - 1;
+		char data[1 << 12], zero[1 << 12] = { };
+		memset(data, 0xaa, sizeof(data));
+		assert(!diskwrite(fd, data, sizeof(data), last << sb->blockbits));
+		block_t free = sb->freeblocks;
+		assert(trim_free(sb, last & ~7, 8, 1) == 8);
+		assert(!diskread(fd, data, sizeof(data), last << sb->blockbits));
+		assert(!memcmp(data, zero, sizeof(zero)));
+		/* the runs were only claimed while being discarded */
+		assert(sb->freeblocks == free);
+		unsigned mapshift = sb->blockbits + 3;
+		struct buffer_head *buffer = blockread(mapping(sb->bitmap), last >> mapshift);
+		assert(all_clear(bufdata(buffer), (last & ~7) & ((1 << mapshift) - 1), 8));
+		blockput(buffer);
+	}
+
+	if (1) { /* a fragmented volume maps a write as many short extents */
+		struct inode *inode = tuxcreate(sb->rootdir, "frag", 4, &(struct tux_iattr){ .mode = S_IFREG | S_IRWXU });
+		assert(inode);
+		struct file *file = &(struct file){ .f_inode = inode };
+		block_t *taken = malloc(sb->volblocks * sizeof(*taken)), block;
+		unsigned count = 0;
+		while (!balloc(sb, 1, &block))
+			taken[count++] = block;
+		/* leave 40 free blocks, none of them next to another */
+		assert(count > 80);
+		for (int i = 0; i < 80; i += 2)
+			assert(!bfree(sb, taken[i], 1));
+		static char data[15 << 12], back[15 << 12];
+		for (int i = 0; i < sizeof(data); i++)
+			data[i] = i * 7;
+		assert(tuxwrite(file, data, sizeof(data)) == sizeof(data));
+		assert(!sync_inode(inode));
+		invalidate_buffers(mapping(inode));
+		tuxseek(file, 0);
+		assert(tuxread(file, back, sizeof(back)) == sizeof(back));
+		assert(!memcmp(data, back, sizeof(data)));
+		free(taken);
+		iput(inode);
+	}
+
 	exit(0);
 eek:
 	return error("Eek! %s", strerror(errno));
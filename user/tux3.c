@@ -14,7 +14,7 @@
 
 static void usage(void)
 {
-	printf("tux3 [-s|--seek=<offset>] [-b|--blocksize=<size>] [-h|--help]\n"
+	printf("tux3 [-s|--seek=<offset>] [-b|--blocksize=<size>] [-d|--discard] [-h|--help]\n"
 	       "     <command> <volume> [<file>]\n");
 	exit(1);
 }
@@ -62,20 +62,108 @@ static int mkfs(int fd, const char *volname, unsigned blocksize)
 	return err;
 }
 
+static void show_btree_stats(const char *name, struct btree_stats *stats)
+{
+	printf("%s: depth %u, %Lu nodes, %Lu leaves", name, stats->depth,
+	       (L)stats->nodes, (L)stats->leaves);
+	if (stats->nodes)
+		printf(", %Lu entries per node", (L)(stats->entries / stats->nodes));
+	printf(", %Lu leaf jumps, %Lu/%Lu blocks cached\n", (L)stats->jumps,
+	       (L)stats->cached, (L)(stats->nodes + stats->leaves));
+	printf("    leaf fill:");
+	for (int i = 0; i < STATS_FILL_BUCKETS; i++)
+		printf(" %i%%:%Lu", i * 100 / STATS_FILL_BUCKETS, (L)stats->fill[i]);
+	printf("\n");
+}
+
+struct dtree_stats_state {
+	struct sb *sb;
+	struct btree_stats stats;
+};
+
+static int dtree_stats_inode(void *data, inum_t inum)
+{
+	struct dtree_stats_state *ds = data;
+
+	/* special inodes and the root directory are shown on their own */
+	if (inum <= TUX_ROOTDIR_INO)
+		return 0;
+	struct inode *inode = iget(ds->sb, inum);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+	int err = btree_stats(&tux_inode(inode)->btree, &ds->stats);
+	iput(inode);
+	return err;
+}
+
+/* Every inode in the itable, in any directory, adds its dtree to @ds */
+static int dtree_stats(struct dtree_stats_state *ds)
+{
+	struct btree *itable = itable_btree(ds->sb);
+	struct cursor *cursor = alloc_cursor(itable, 0);
+	int err;
+
+	if (!cursor)
+		return -ENOMEM;
+	if ((err = scan_begin(cursor, 0, TUXKEY_LIMIT)))
+		goto out;
+	do {
+		err = ileaf_enumerate(itable, bufdata(cursor_leafbuf(cursor)),
+				      dtree_stats_inode, ds);
+		if (err) {
+			release_cursor(cursor);
+			break;
+		}
+	} while ((err = scan_next(cursor, TUXKEY_LIMIT)) > 0);
+out:
+	free_cursor(cursor);
+	return err;
+}
+
+/* Shape of the volume btrees, and of all file dtrees together */
+static int volume_stats(struct sb *sb)
+{
+	struct { const char *name; struct btree *btree; } trees[] = {
+		{ "itable", itable_btree(sb) },
+		{ "atable", &tux_inode(sb->atable)->btree },
+		{ "bitmap", &tux_inode(sb->bitmap)->btree },
+		{ "rootdir", &tux_inode(sb->rootdir)->btree },
+	};
+	int err;
+
+	for (int i = 0; i < ARRAY_SIZE(trees); i++) {
+		struct btree_stats stats = { };
+		if ((err = btree_stats(trees[i].btree, &stats)))
+			return err;
+		show_btree_stats(trees[i].name, &stats);
+	}
+
+	struct dtree_stats_state ds = { .sb = sb };
+	if ((err = dtree_stats(&ds)))
+		return err;
+	show_btree_stats("file dtrees", &ds.stats);
+
+	char text[256];
+	format_delta_stats(sb, text, sizeof(text));
+	printf("%s", text);
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	char *seekarg = NULL;
-	unsigned blocksize = 0;
+	unsigned blocksize = 0, discard = 0;
 	static struct option long_options[] = {
 		{ "seek", required_argument, NULL, 's' },
 		{ "blocksize", required_argument, NULL, 'b' },
+		{ "discard", no_argument, NULL, 'd' },
 		{ "help", no_argument, NULL, 'h' },
 		{ NULL, 0, NULL, 0 }
 	};
 
 	while (1) {
 		int c, optindex = 0;
-		c = getopt_long(argc, argv, "s:b:h", long_options, &optindex);
+		c = getopt_long(argc, argv, "s:b:dh", long_options, &optindex);
 		if (c == -1)
 			break;
 		switch (c) {
@@ -85,6 +173,9 @@ int main(int argc, char *argv[])
 		case 'b':
 			blocksize = strtoul(optarg, NULL, 0);
 			break;
+		case 'd':
+			discard = 1;
+			break;
 		case 'h':
 		default:
 			goto usage;
@@ -115,6 +206,7 @@ int main(int argc, char *argv[])
 	if ((errno = -load_sb(sb)))
 		goto eek;
 	dev->bits = sb->blockbits;
+	sb->discard = discard;
 	init_buffers(dev, 1 << 20, 1);
 
 	sb->volmap = tux_new_volmap(sb);
@@ -148,6 +240,23 @@ int main(int argc, char *argv[])
 	show_tree_range(&sb->rootdir->btree, 0, -1);
 	show_tree_range(&sb->bitmap->btree, 0, -1);
 
+	if (!strcmp(command, "fstrim")) {
+		unsigned minlen = optind < argc ? strtoul(argv[optind], NULL, 0) : 1;
+		block_t trimmed = trim_free(sb, 0, sb->volblocks, minlen);
+		if (trimmed < 0) {
+			errno = -trimmed;
+			goto eek;
+		}
+		printf("trimmed %Lu blocks\n", (L)trimmed);
+		goto out;
+	}
+
+	if (!strcmp(command, "stat") && optind == argc) {
+		if ((errno = -volume_stats(sb)))
+			goto eek;
+		goto out;
+	}
+
 	if (argc - optind < 1)
 		goto usage;
 	char *filename = argv[optind++];
@@ -301,6 +410,7 @@ int main(int argc, char *argv[])
 			goto eek;
 	}
 
+out:
 	//printf("---- show state ----\n");
 	//show_buffers(sb->rootdir->map);
 	//show_buffers(sb->volmap->map);
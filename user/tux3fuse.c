@@ -36,6 +36,7 @@
  */
 
 //#include <sys/xattr.h>
+#include <fcntl.h>		/* for FALLOC_FL_KEEP_SIZE */
 #include "trace.h"
 #include "tux3user.h"
 
@@ -426,11 +427,15 @@ eek:
 	exit(1);
 }
 
-/* Stub methods */
 static void tux3_destroy(void *userdata)
 {
+	char text[256];
+
+	format_delta_stats(sb, text, sizeof(text));
+	printf("%s", text);
 }
 
+/* Stub methods */
 static void tux3_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
 {
 	fuse_reply_none(req);
@@ -537,17 +542,33 @@ static void tux3_access(fuse_req_t req, fuse_ino_t ino, int mask)
 	fuse_reply_err(req, 0);
 }
 
+/*
+ * fsync, fsyncdir and flush wait for the current delta to commit.
+ * Userspace writes dirty inodes in place instead of staging them in the
+ * delta, so write those first, then sync_delta() commits what is left of
+ * the delta, or shares a commit already under way, and reports the error
+ * of a delta that failed to commit.
+ */
+static int tux3_sync(void)
+{
+	int err;
+
+	if (!list_empty(&sb->dirty_inodes) && (err = sync_super(sb)))
+		return err;
+	return sync_delta(sb, sb->delta);
+}
+
 static void tux3_fsyncdir(fuse_req_t req, fuse_ino_t ino,
 	int datasync, struct fuse_file_info *fi)
 {
-	warn("not implemented");
-	fuse_reply_err(req, ENOSYS);
+	trace("fsyncdir (%Lx)", (L)ino);
+	fuse_reply_err(req, -tux3_sync());
 }
 
 static void tux3_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	warn("not implemented");
-	fuse_reply_err(req, ENOSYS);
+	trace("flush (%Lx)", (L)ino);
+	fuse_reply_err(req, -tux3_sync());
 }
 
 static void tux3_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
@@ -566,8 +587,8 @@ static void tux3_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *
 static void tux3_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
 	struct fuse_file_info *fi)
 {
-	warn("not implemented");
-	fuse_reply_err(req, ENOSYS);
+	trace("fsync (%Lx)", (L)ino);
+	fuse_reply_err(req, -tux3_sync());
 }
 
 static void tux3_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
@@ -660,6 +681,27 @@ static void tux3_setlk(fuse_req_t req, fuse_ino_t ino,
 	fuse_reply_err(req, ENOSYS);
 }
 
+static void tux3_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+	off_t offset, off_t length, struct fuse_file_info *fi)
+{
+	trace("tux3_fallocate(%Lx, %Lx/%Lx)", (L)ino, (L)offset, (L)length);
+	struct inode *inode = (struct inode *)(unsigned long)fi->fh;
+
+	if (mode & ~FALLOC_FL_KEEP_SIZE) {
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+	if ((errno = -tuxfallocate(inode, offset, length, mode & FALLOC_FL_KEEP_SIZE)))
+		goto eek;
+	if ((errno = -sync_super(sb)))
+		goto eek;
+	fuse_reply_err(req, 0);
+	return;
+eek:
+	warn("Eek! %s", strerror(errno));
+	fuse_reply_err(req, errno);
+}
+
 static void tux3_bmap(fuse_req_t req, fuse_ino_t ino, size_t blocksize, uint64_t idx)
 {
 	warn("not implemented");
@@ -701,6 +743,7 @@ static struct fuse_lowlevel_ops tux3_ops = {
 	.getlk = tux3_getlk,
 	.setlk = tux3_setlk,
 	.bmap = tux3_bmap,
+	.fallocate = tux3_fallocate,
 };
 
 int main(int argc, char *argv[])
@@ -116,13 +116,15 @@ static void draw_sb(struct graph_info *gi, struct sb *sb)
 		(L)from_be_u64(txsb->freeblocks),
 		(L)from_be_u64(txsb->nextalloc),
 		from_be_u32(txsb->freeatom), from_be_u32(txsb->atomgen),
-		(L)from_be_u64(txsb->logchain), (L)from_be_u64(txsb->logchain),
+		(L)logchain_block(from_be_u64(txsb->logchain)),
+		(L)logchain_block(from_be_u64(txsb->logchain)),
 		from_be_u32(txsb->logcount), from_be_u32(txsb->next_logcount));
 
 	fprintf(gi->f, "tux3_sb:iroot0:e -> %s_bnode_%llu:n;\n\n",
 		gi->bname, (L)itable_btree(sb)->root.block);
 	fprintf(gi->f, "tux3_sb:logchain_%llu:e -> logchain_%llu:n;\n\n",
-		(L)from_be_u64(txsb->logchain), (L)from_be_u64(txsb->logchain));
+		(L)logchain_block(from_be_u64(txsb->logchain)),
+		(L)logchain_block(from_be_u64(txsb->logchain)));
 }
 
 static void draw_log(struct graph_info *gi, struct sb *sb,
@@ -138,7 +140,7 @@ static void draw_log(struct graph_info *gi, struct sb *sb,
 		(L)buffer->index, (L)buffer->index, (L)buffer->index,
 		buffer_dirty(buffer) ? ", dirty" : "",
 		from_be_u16(log->magic), from_be_u16(log->bytes),
-		(L)from_be_u64(log->logchain));
+		(L)logchain_block(from_be_u64(log->logchain)));
 
 	while (data < log->data + from_be_u16(log->bytes)) {
 		unsigned char code = *data++;
@@ -146,9 +148,10 @@ static void draw_log(struct graph_info *gi, struct sb *sb,
 		case LOG_BALLOC:
 		case LOG_BFREE:
 		case LOG_BFREE_ON_ROLLUP: {
-			unsigned count = *data++;
+			unsigned count;
 			u64 block;
 			char *name;
+			data = decode16(data, &count);
 			data = decode48(data, &block);
 			if (code == LOG_BALLOC)
 				name = "LOG_BALLOC";
@@ -175,6 +178,19 @@ static void draw_log(struct graph_info *gi, struct sb *sb,
 				name, (L)old, (L)new);
 			break;
 		}
+		case LOG_REDIRECT_PATH: {
+			unsigned levels = *data++;
+			u64 newbase, old;
+			data = decode48(data, &newbase);
+			fprintf(gi->f, " | [LOG_REDIRECT_PATH] levels %u, new %llu, old",
+				levels, (L)newbase);
+			for (unsigned i = 0; i < levels; i++) {
+				data = decode48(data, &old);
+				fprintf(gi->f, " %llu", (L)old);
+			}
+			fprintf(gi->f, " ");
+			break;
+		}
 		case LOG_BNODE_ROOT: {
 			u64 root, left, right, rkey;
 			unsigned count = *data++;
@@ -239,7 +255,7 @@ static void draw_logchain(struct graph_info *gi, struct sb *sb)
 		"subgraph cluster_logchain {\n"
 		"label = \"logchain\"\n");
 
-	nextchain = from_be_u64(sb->super.logchain);
+	nextchain = logchain_block(from_be_u64(sb->super.logchain));
 	logcount = from_be_u32(sb->super.logcount);
 	while (logcount > 0) {
 		buffer = vol_bread(sb, nextchain);
@@ -251,9 +267,9 @@ static void draw_logchain(struct graph_info *gi, struct sb *sb)
 		if (logcount) {
 			fprintf(gi->f,
 				"logchain_%llu:f0:e -> logchain_%llu:n;\n",
-				(L)nextchain, (L)from_be_u64(log->logchain));
+				(L)nextchain, (L)logchain_block(from_be_u64(log->logchain)));
 		}
-		nextchain = from_be_u64(log->logchain);
+		nextchain = logchain_block(from_be_u64(log->logchain));
 		blockput(buffer);
 	}
 
@@ -385,7 +401,7 @@ static void walk_dtree(struct graph_info *gi, struct btree *btree,
 {
 	struct cursor *cursor = alloc_cursor(btree, 0);
 	assert(cursor);
-	int err = probe(cursor, 0);
+	int err = scan_begin(cursor, 0, TUXKEY_LIMIT);
 	assert(!err);
 	struct buffer_head *leafbuf;
 	do {
@@ -399,7 +415,7 @@ static void walk_dtree(struct graph_info *gi, struct btree *btree,
 		do {
 			walk_dleaf(gi, btree, &walk);
 		} while (dwalk_next(&walk));
-	} while (advance(cursor));
+	} while (scan_next(cursor, TUXKEY_LIMIT) > 0);
 	free_cursor(cursor);
 }
 
@@ -626,10 +642,10 @@ static void draw_dleaf(struct graph_info *gi, struct btree *btree, struct buffer
 			for (ex = 0; ex < ex_count; ex++) {
 				fprintf(gi->f,
 					" | <gr%uent%uex%u>"
-					" version 0x%03x, count %u, block %llu "
+					" %scount %u, block %llu "
 					" (extent %u)",
 					gr, ent, ex,
-					extent_version(extents[ex]),
+					extent_unwritten(extents[ex]) ? "unwritten, " : "",
 					extent_count(extents[ex]),
 					(L)extent_block(extents[ex]),
 					ex);
@@ -113,7 +113,11 @@ struct tux_iattr {
 	.blocksize = 1 << (dev)->bits,				\
 	.blockmask = ((1 << (dev)->bits) - 1),			\
 	.delta_lock = __RWSEM_INITIALIZER,			\
+	.policy = INIT_COMMIT_POLICY,				\
 	.loglock = __MUTEX_INITIALIZER,				\
+	.commit_lock = __MUTEX_INITIALIZER,			\
+	.stash_lock = __SPIN_LOCK_UNLOCKED,			\
+	.stash_pool = LINK_INIT_CIRCULAR((sb).stash_pool),	\
 	.alloc_inodes = LIST_HEAD_INIT((sb).alloc_inodes),	\
 	.dirty_inodes = LIST_HEAD_INIT((sb).dirty_inodes),	\
 	.commit = LIST_HEAD_INIT((sb).commit),			\
@@ -148,7 +152,8 @@ void tux_dump_entries(struct buffer_head *buffer);
 
 /* filemap.c */
 int filemap_extent_io(struct buffer_head *buffer, int write);
-int write_bitmap(struct buffer_head *buffer);
+int filemap_mapped(struct inode *inode, block_t index);
+int write_bitmap(struct buffer_head *buffer, void *data);
 
 /* inode.c */
 void iput(struct inode *inode);
@@ -158,6 +163,7 @@ int tuxread(struct file *file, char *data, unsigned len);
 int tuxwrite(struct file *file, const char *data, unsigned len);
 void tuxseek(struct file *file, loff_t pos);
 int tuxtruncate(struct inode *inode, loff_t size);
+int tuxfallocate(struct inode *inode, loff_t offset, loff_t len, int keep_size);
 struct inode *tuxopen(struct inode *dir, const char *name, int len);
 struct inode *__tux_create_inode(struct inode *dir, inum_t goal,
 				 struct tux_iattr *iattr, dev_t rdev);
@@ -170,6 +176,10 @@ int write_inode(struct inode *inode);
 void stacktrace(void);
 int devio(int rw, struct dev *dev, loff_t offset, void *data, unsigned len);
 int blockio(int rw, struct buffer_head *buffer, block_t block);
+int blockio_vec(int rw, struct buffer_head *buffers[], unsigned count, block_t block);
+int blockdiscard(struct sb *sb, block_t block, block_t count);
+void blockreadahead(struct sb *sb, block_t block);
+int blockcached(struct sb *sb, block_t block);
 
 /* super.c */
 int make_tux3(struct sb *sb);
@@ -25,6 +25,56 @@ int blockio(int rw, struct buffer_head *buffer, block_t block)
 		     sb->blocksize);
 }
 
+/* Transfer buffers to or from consecutive blocks, one syscall per batch */
+int blockio_vec(int rw, struct buffer_head *buffers[], unsigned count, block_t block)
+{
+	struct sb *sb = tux_sb(buffer_inode(buffers[0])->i_sb);
+	struct iovec iov[64];
+
+	trace("%s: %u buffers, block %Lx", rw ? "write" : "read", count, (L)block);
+	while (count) {
+		unsigned batch = min_t(unsigned, count, ARRAY_SIZE(iov));
+		for (int i = 0; i < batch; i++)
+			iov[i] = (struct iovec){
+				.iov_base = bufdata(buffers[i]),
+				.iov_len = sb->blocksize,
+			};
+		int err = iovabs(sb_dev(sb)->fd, iov, batch, rw, block << sb->blockbits);
+		if (err)
+			return err;
+		buffers += batch;
+		block += batch;
+		count -= batch;
+	}
+	return 0;
+}
+
+int blockdiscard(struct sb *sb, block_t block, block_t count)
+{
+	trace("discard: block %Lx/%Lx", (L)block, (L)count);
+	return fddiscard(sb_dev(sb)->fd, block << sb->blockbits, count << sb->blockbits);
+}
+
+/* Start reading a volume block the cache does not have yet */
+void blockreadahead(struct sb *sb, block_t block)
+{
+	if (blockcached(sb, block))
+		return;
+	trace("readahead: block %Lx", (L)block);
+	fdreadahead(sb_dev(sb)->fd, block << sb->blockbits, sb->blocksize);
+}
+
+/* Does the cache hold the data of a volume block? */
+int blockcached(struct sb *sb, block_t block)
+{
+	struct buffer_head *buffer = blockpeek(mapping(sb->volmap), block);
+
+	if (!buffer)
+		return 0;
+	blockput(buffer);
+	return 1;
+}
+
 unsigned long find_next_bit(const unsigned long *addr, unsigned long size,
 			    unsigned long offset)
 {
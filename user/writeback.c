@@ -116,7 +116,9 @@ static void cleanup_garbage_for_writeback(struct sb *sb)
 	 * Clean garbage (atomic commit) stuff. Don't forget to update
 	 * this, if you update the atomic commit.
 	 */
+	mutex_lock(&sb->loglock);
 	log_finish(sb);
+	mutex_unlock(&sb->loglock);
 
 	sb->logchain = 0;
 	sb->logbase = sb->next_logbase = 0;